@@ -3,6 +3,30 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+// Build with -DWITH_ALSA=0 to drop the ALSA capture source and the libasound dependency.
+#ifndef WITH_ALSA
+#define WITH_ALSA 1
+#endif
+// Build with -DCOUNT_ALLOCATIONS=1 (glibc only) to let --bench check the frame writer for heap
+// allocations. It replaces malloc for the whole process, so release builds leave it off.
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 0
+#endif
+#if WITH_ALSA
+#include <alsa/asoundlib.h>
+#endif
 #include <iostream>
 #include <string>
 #include <chrono>
@@ -10,6 +34,21 @@
 #include <atomic>
 #include <fstream>
 #include <vector> 
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <memory>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -18,304 +57,5048 @@ extern "C" {
 #include <libswscale/swscale.h>
 #include <libavutil/opt.h>
 #include <libavutil/samplefmt.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
 #include <libswresample/swresample.h>
+#include <libavutil/version.h>
+#include <libswscale/version.h>
+#include <libswresample/version.h>
 }
 
+// sws_scale_frame and the swscale "threads" option arrived in libswscale 6.1 (FFmpeg 5.0);
+// AVChannelLayout and swr_alloc_set_opts2 need FFmpeg 5.1.
+#if LIBSWSCALE_VERSION_INT < AV_VERSION_INT(6, 1, 100)
+#error "libswscale 6.1 (FFmpeg 5.0) or newer is required for sws_scale_frame and threaded scaling"
+#endif
+#if LIBAVUTIL_VERSION_INT < AV_VERSION_INT(57, 28, 100) || LIBSWRESAMPLE_VERSION_INT < AV_VERSION_INT(4, 7, 100)
+#error "FFmpeg 5.1 or newer is required for the AVChannelLayout audio API"
+#endif
+
 const int WINDOW_WIDTH = 800;
 const int WINDOW_HEIGHT = 600;
 const int TOOLBAR_HEIGHT = 50;
 const float PREVIEW_SCALE = 0.4f;
+const int PREVIEW_FPS = 15;
+const size_t TEXT_CACHE_ENTRIES = 16;
 const SDL_Color BUTTON_COLOR = {50, 50, 50, 255};
 const SDL_Color BUTTON_HOVER_COLOR = {70, 70, 70, 255};
 const SDL_Color BUTTON_TEXT_COLOR = {255, 255, 255, 255};
+const SDL_Color OVERLAY_TEXT_COLOR = {180, 180, 180, 255};
+const char* FONT_PATH = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
+
+const int TARGET_FPS = 30;
+const int TARGET_BITRATE = 8000000;
+const char* TARGET_FORMAT = "mp4";
+const size_t MAX_QUEUED_FRAMES = 8;
+const double PSNR_REGRESSION_DB = 0.5;
+const double SSIM_REGRESSION = 0.005;
+const double MAX_PSNR_DB = 100.0;
+const int CRASH_TEST_SECONDS = 5;
+const double CRASH_TEST_MIN_PSNR_DB = 25.0;
+const AVRational VIDEO_TIME_BASE = {1, TARGET_FPS};
+const int AUDIO_SAMPLE_RATE = 48000;
+const int AUDIO_CHANNELS = 2;
+const int AUDIO_BITRATE = 128000;
+const int AUDIO_CHUNK_FRAMES = 1024;
+const size_t AUDIO_RING_CHUNKS = 64;
+const AVRational AUDIO_TIME_BASE = {1, AUDIO_SAMPLE_RATE};
+const int VIDEO_STREAM_INDEX = 0;
+const int AUDIO_STREAM_INDEX = 1;
+const int TILE_SIZE = 64;
+const int DEDUP_REPEAT_FRAMES = TARGET_FPS / 2;
+
+struct EncoderProfile {
+    const char* name;
+    const char* preset;
+    const char* tune;
+    int crf;
+    int gopSize;
+    int maxBFrames;
+    int threadType;
+    int lookahead;
+    bool capBitrate;
+};
+
+const EncoderProfile ENCODER_PROFILES[] = {
+    {"realtime", "veryfast", "zerolatency", 23, TARGET_FPS * 2, 0, FF_THREAD_SLICE, 0, true},
+    {"balanced", "medium", "film", 18, 10, 1, FF_THREAD_FRAME, -1, false},
+    {"archival", "slow", "film", 16, TARGET_FPS * 4, 3, FF_THREAD_FRAME, 60, false},
+};
+const int ENCODER_PROFILE_COUNT = sizeof(ENCODER_PROFILES) / sizeof(ENCODER_PROFILES[0]);
+
+const char* const PRESET_LADDER[] = {
+    "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower"
+};
+const int PRESET_LADDER_COUNT = sizeof(PRESET_LADDER) / sizeof(PRESET_LADDER[0]);
+const int ADAPT_IDLE_GOPS = 3;
+const int ADAPT_MIN_SWITCH_SECONDS = 5;
+
+struct Options {
+    bool useShm = true;
+    bool benchConvert = false;
+    bool benchScale = false;
+    bool variableFrameRate = false;
+    bool deduplicate = false;
+    bool incremental = false;
+    int replaySeconds = 0;
+    bool fragmented = false;
+    int segmentSeconds = 0;
+    int segmentMegabytes = 0;
+    std::string benchScene;
+    int benchWidth = 1920;
+    int benchHeight = 1080;
+    int benchFrames = 300;
+    std::string statsFile;
+    int scaleWidth = 0;
+    int scaleHeight = 0;
+    int scaleFlags = SWS_BILINEAR;
+    int profile = 1;
+    bool adaptive = false;
+    std::string audioSource;
+    bool benchAudio = false;
+    bool benchCrash = false;
+    bool benchRestart = false;
+    bool lossless = false;
+    std::string transcodeInput;
+    std::string outputName;
+    bool desktop = false;
+    bool hasRegion = false;
+    int regionX = 0;
+    int regionY = 0;
+    int regionWidth = 0;
+    int regionHeight = 0;
+    unsigned long windowId = 0;
+    int previewFps = PREVIEW_FPS;
+    bool previewWhileRecording = true;
+    bool headless = false;
+    std::string controlSocket;
+    bool drawCursor = true;
+    std::string baselineFile;
+    std::string writeBaselineFile;
+    double fpsTolerance = 10.0;
+};
+
+struct Button {
+    SDL_Rect rect;
+    std::string label;
+    bool isHovered;
+    bool isPressed;
+};
+
+struct CachedText {
+    TTF_Font* font;
+    std::string text;
+    SDL_Color color;
+    SDL_Texture* texture;
+    int width;
+    int height;
+    uint64_t lastUsed;
+};
+
+struct TextCache {
+    std::vector<CachedText> entries;
+    uint64_t uses;
+};
+
+struct PixelLayout {
+    int bitsPerPixel;
+    int redShift;
+    int greenShift;
+    int blueShift;
+    int redBits = 8;
+    int greenBits = 8;
+    int blueBits = 8;
+    bool swapBytes = false;
+};
+
+typedef void (*ConvertRowPairFn)(const uint8_t* row0, const uint8_t* row1, int width,
+                                 const PixelLayout& layout, uint8_t* y0, uint8_t* y1,
+                                 uint8_t* u, uint8_t* v);
+
+struct TileDamage {
+    int tilesX;
+    int tilesY;
+    std::vector<uint64_t> hashes;
+    std::vector<uint64_t> scratch;
+    std::vector<uint8_t> dirty;
+    int dirtyCount;
+    bool primed;
+};
+
+struct FrameSlot {
+    AVFrame* frame;
+    int users;
+    std::vector<uint8_t> stale;
+};
+
+struct QueuedFrame {
+    AVFrame* frame;
+    int slot;
+    int64_t pts;
+    bool keyframe;
+};
+
+struct ReplayBuffer {
+    std::mutex mutex;
+    std::deque<AVPacket*> packets;
+    int64_t bytes;
+    int64_t maxBytes;
+    int64_t maxDuration;
+};
+
+struct AudioChunk {
+    int64_t captureMicros;
+    int frames;
+    int16_t samples[AUDIO_CHUNK_FRAMES * AUDIO_CHANNELS];
+};
+
+struct AudioRing {
+    std::vector<AudioChunk> chunks;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+struct AudioSource {
+    int sampleRate = AUDIO_SAMPLE_RATE;
+    int channels = AUDIO_CHANNELS;
+    virtual ~AudioSource() {}
+    virtual int read(int16_t* samples, int frames) = 0;
+    virtual int64_t delayFrames() { return 0; }
+};
+
+struct AudioPipeline {
+    std::unique_ptr<AudioSource> source;
+    AVCodecContext* codecContext;
+    AVCodecParameters* parameters;
+    SwrContext* swrContext;
+    AVAudioFifo* fifo;
+    AVFrame* frame;
+    std::vector<float> planes[AUDIO_CHANNELS];
+    int64_t nextPts;
+    bool started;
+    AudioRing ring;
+    std::atomic<int64_t> overruns;
+    std::atomic<bool> stop;
+    std::atomic<bool> captureDone;
+    std::thread captureThread;
+    std::thread encoderThread;
+};
+
+struct CursorPlanes {
+    unsigned long serial;
+    int parityX, parityY;
+    int width, height;
+    std::vector<int16_t> luma;
+    std::vector<int16_t> cb;
+    std::vector<int16_t> cr;
+    std::vector<uint8_t> lumaAlpha;
+    std::vector<uint8_t> chromaAlpha;
+    bool drawn;
+    int drawnX, drawnY;
+};
+
+struct RecordingContext {
+    AVFormatContext* formatContext;
+    AVCodecContext* videoCodecContext;
+    AVCodecContext* warmEncoder;
+    std::thread warmThread;
+    AVStream* videoStream;
+    AVCodecParameters* videoParameters;
+    SwsContext* swsContext;
+    AVBufferPool* framePool;
+    AVFrame* convertedFrame;
+    int inputWidth;
+    int inputHeight;
+    AVFrame* resizedFrame;
+    SwsContext* resizeContext;
+    std::vector<FrameSlot> frameSlots;
+    int lastSlot;
+    std::atomic<bool> isRecording;
+    std::atomic<bool> isInitialized;
+    std::string filename;
+    bool variableFrameRate;
+    bool deduplicate;
+    bool incremental;
+    int replaySeconds;
+    ReplayBuffer replay;
+    bool fragmented;
+    int segmentSeconds;
+    int segmentMegabytes;
+    int scaleWidth;
+    int scaleHeight;
+    int scaleFlags;
+    const EncoderProfile* profile;
+    bool adaptive;
+    int presetIndex;
+    int minPresetIndex;
+    int maxPresetIndex;
+    int gopFrames;
+    int gopMaxQueueDepth;
+    int idleGops;
+    std::chrono::steady_clock::time_point lastPresetSwitch;
+    bool lossless;
+    std::string spoolFilename;
+    std::string audioSource;
+    AudioPipeline audio;
+    AVStream* audioStream;
+    std::mutex muxMutex;
+    std::deque<AVPacket*> pendingAudio;
+    int64_t lastVideoDts;
+    int segmentIndex;
+    int64_t segmentStartDts;
+    TileDamage damage;
+    CursorPlanes cursorPlanes;
+    ConvertRowPairFn convert;
+    std::chrono::steady_clock::time_point startTime;
+    int64_t lastPts;
+    int64_t lastSkippedPts;
+    bool forceKeyframe;
+    std::atomic<int64_t> capturedFrames;
+    std::atomic<int64_t> skippedFrames;
+    std::atomic<int64_t> lateFrames;
+    std::atomic<int64_t> duplicatedFrames;
+    std::atomic<int64_t> droppedFrames;
+    std::mutex sessionMutex;
+    std::thread encoderThread;
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    std::vector<QueuedFrame> frameQueue;
+    bool stopEncoder;
+};
+
+struct CursorImage {
+    bool enabled;
+    int eventBase;
+    bool stale;
+    unsigned long serial;
+    int width, height;
+    int hotX, hotY;
+    std::vector<uint32_t> pixels;
+    int x, y;
+};
+
+struct ScreenCapture {
+    Display* display;
+    Window root;
+    Window window;
+    int rootWidth, rootHeight;
+    int x, y, width, height;
+    std::atomic<uint32_t> liveSize;
+    std::atomic<bool> windowLost;
+    std::atomic<bool> useShm;
+    XShmSegmentInfo shmInfo;
+    XImage* shmImage;
+    CursorImage cursor;
+};
+
+struct PreviewBuffer {
+    std::mutex mutex;
+    std::vector<uint8_t> pixels;
+    std::vector<uint8_t> staging;
+    int width;
+    int height;
+    int fps;
+    bool whileRecording;
+    SwsContext* scaler;
+    bool updated;
+    Uint32 eventType;
+};
+
+enum class PipelineStage {
+    Capture,
+    Convert,
+    Scale,
+    Preview,
+    Encode,
+    Count
+};
+
+const int STAGE_COUNT = static_cast<int>(PipelineStage::Count);
+const int HISTOGRAM_BUCKETS = 84;
+const char* const STAGE_NAMES[STAGE_COUNT] = {"capture", "convert", "scale", "preview", "encode"};
+
+struct StageHistogram {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> totalMicros;
+};
+
+struct Telemetry {
+    StageHistogram stages[STAGE_COUNT];
+    std::atomic<int> queueDepth;
+    std::atomic<int> maxQueueDepth;
+    std::atomic<uint64_t> poolAllocations;
+    std::atomic<uint64_t> countedAllocations;
+    std::atomic<uint64_t> convertedTiles;
+    std::atomic<uint64_t> copiedTiles;
+    std::atomic<uint64_t> uiRedraws;
+    std::atomic<uint64_t> uiCpuMicros;
+};
+
+struct TelemetrySnapshot {
+    uint64_t buckets[STAGE_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t count[STAGE_COUNT];
+    uint64_t totalMicros[STAGE_COUNT];
+};
+
+struct StageSummary {
+    uint64_t count;
+    double meanMs;
+    double p50Ms;
+    double p90Ms;
+    double p99Ms;
+};
+
+static Telemetry telemetry;
+
+static thread_local bool countingAllocations = false;
+
+struct CountAllocations {
+    bool previous;
+
+    explicit CountAllocations(bool enabled) : previous(countingAllocations) { countingAllocations = enabled; }
+    ~CountAllocations() { countingAllocations = previous; }
+};
+
+inline void countAllocation() {
+    if (countingAllocations) telemetry.countedAllocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if COUNT_ALLOCATIONS && defined(__GLIBC__)
+const bool ALLOCATION_COUNTING = true;
+
+// Test builds wrap the glibc heap entry points so benchmarks can count every allocation a thread
+// makes inside a CountAllocations scope, including operator new and av_malloc. free is wrapped
+// too so both halves always resolve to the same allocator.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* pointer);
+
+void* malloc(size_t size) noexcept {
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) noexcept {
+    countAllocation();
+    return __libc_realloc(pointer, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) noexcept {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    countAllocation();
+    void* result = __libc_memalign(alignment, size);
+    if (!result) return ENOMEM;
+    *pointer = result;
+    return 0;
+}
+
+void free(void* pointer) noexcept {
+    __libc_free(pointer);
+}
+}
+#else
+const bool ALLOCATION_COUNTING = false;
+#endif
+
+inline int histogramBucket(uint64_t micros) {
+    if (micros < 4) return static_cast<int>(micros);
+    int log = 63 - __builtin_clzll(micros);
+    int bucket = (log - 1) * 4 + static_cast<int>((micros >> (log - 2)) & 3);
+    return std::min(bucket, HISTOGRAM_BUCKETS - 1);
+}
+
+inline uint64_t histogramBucketStart(int bucket) {
+    if (bucket < 4) return bucket;
+    int log = bucket / 4 + 1;
+    return static_cast<uint64_t>(4 + bucket % 4) << (log - 2);
+}
+
+inline void recordStage(PipelineStage stage, std::chrono::steady_clock::duration elapsed) {
+    uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    StageHistogram& histogram = telemetry.stages[static_cast<int>(stage)];
+    histogram.buckets[histogramBucket(micros)].fetch_add(1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    histogram.totalMicros.fetch_add(micros, std::memory_order_relaxed);
+}
+
+inline void recordQueueDepth(int depth) {
+    telemetry.queueDepth.store(depth, std::memory_order_relaxed);
+    int maxDepth = telemetry.maxQueueDepth.load(std::memory_order_relaxed);
+    while (depth > maxDepth &&
+           !telemetry.maxQueueDepth.compare_exchange_weak(maxDepth, depth, std::memory_order_relaxed)) {
+    }
+}
+
+struct StageTimer {
+    PipelineStage stage;
+    std::chrono::steady_clock::time_point start;
+
+    explicit StageTimer(PipelineStage stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+    ~StageTimer() { recordStage(stage, std::chrono::steady_clock::now() - start); }
+};
+
+TelemetrySnapshot takeTelemetrySnapshot() {
+    TelemetrySnapshot snapshot;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const StageHistogram& histogram = telemetry.stages[stage];
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            snapshot.buckets[stage][bucket] = histogram.buckets[bucket].load(std::memory_order_relaxed);
+        }
+        snapshot.count[stage] = histogram.count.load(std::memory_order_relaxed);
+        snapshot.totalMicros[stage] = histogram.totalMicros.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+StageSummary summarizeStage(const TelemetrySnapshot& current, const TelemetrySnapshot* previous, int stage) {
+    StageSummary summary = {};
+    summary.count = current.count[stage] - (previous ? previous->count[stage] : 0);
+    if (summary.count == 0) return summary;
+
+    uint64_t totalMicros = current.totalMicros[stage] - (previous ? previous->totalMicros[stage] : 0);
+    summary.meanMs = totalMicros / 1000.0 / summary.count;
+
+    const double fractions[3] = {0.50, 0.90, 0.99};
+    double* results[3] = {&summary.p50Ms, &summary.p90Ms, &summary.p99Ms};
+    uint64_t seen = 0;
+    int next = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS && next < 3; bucket++) {
+        seen += current.buckets[stage][bucket] - (previous ? previous->buckets[stage][bucket] : 0);
+        while (next < 3 && seen >= fractions[next] * summary.count) {
+            *results[next++] = histogramBucketStart(bucket + 1) / 1000.0;
+        }
+    }
+    return summary;
+}
+
+std::string telemetryOverlayText(const TelemetrySnapshot& current, const TelemetrySnapshot* previous,
+                                 const RecordingContext& ctx) {
+    std::string text = "p90 ms";
+    char part[64];
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        StageSummary summary = summarizeStage(current, previous, stage);
+        snprintf(part, sizeof(part), " %s %.1f", STAGE_NAMES[stage], summary.p90Ms);
+        text += part;
+    }
+    snprintf(part, sizeof(part), " | queue %d | dropped %lld", telemetry.queueDepth.load(),
+             static_cast<long long>(ctx.droppedFrames));
+    text += part;
+    return text;
+}
+
+std::string telemetryJson(const TelemetrySnapshot& current, const TelemetrySnapshot* previous,
+                          const RecordingContext& ctx) {
+    char buffer[384];
+    snprintf(buffer, sizeof(buffer), "{\"time\":%lld,\"recording\":%s,\"stages\":{",
+             static_cast<long long>(time(nullptr)), ctx.isRecording ? "true" : "false");
+    std::string json = buffer;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        StageSummary summary = summarizeStage(current, previous, stage);
+        snprintf(buffer, sizeof(buffer),
+                 "%s\"%s\":{\"count\":%llu,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f}",
+                 stage ? "," : "", STAGE_NAMES[stage], static_cast<unsigned long long>(summary.count),
+                 summary.meanMs, summary.p50Ms, summary.p90Ms, summary.p99Ms);
+        json += buffer;
+    }
+    snprintf(buffer, sizeof(buffer),
+             "},\"queue_depth\":%d,\"max_queue_depth\":%d,\"captured\":%lld,\"late\":%lld,"
+             "\"duplicated\":%lld,\"dropped\":%lld,\"skipped\":%lld,\"pool_allocations\":%llu,"
+             "\"ui_redraws\":%llu,\"ui_cpu_ms\":%.1f}",
+             telemetry.queueDepth.load(), telemetry.maxQueueDepth.load(),
+             static_cast<long long>(ctx.capturedFrames), static_cast<long long>(ctx.lateFrames),
+             static_cast<long long>(ctx.duplicatedFrames), static_cast<long long>(ctx.droppedFrames),
+             static_cast<long long>(ctx.skippedFrames),
+             static_cast<unsigned long long>(telemetry.poolAllocations.load()),
+             static_cast<unsigned long long>(telemetry.uiRedraws.load()),
+             telemetry.uiCpuMicros.load() / 1000.0);
+    json += buffer;
+    return json;
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-shm") {
+            options.useShm = false;
+        } else if (arg == "--bench-convert") {
+            options.benchConvert = true;
+        } else if (arg == "--bench-scale") {
+            options.benchScale = true;
+        } else if (arg == "--vfr") {
+            options.variableFrameRate = true;
+        } else if (arg == "--dedup") {
+            options.deduplicate = true;
+        } else if (arg == "--incremental") {
+            options.incremental = true;
+        } else if (arg == "--replay" && i + 1 < argc) {
+            options.replaySeconds = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--fragmented") {
+            options.fragmented = true;
+        } else if (arg == "--segment-seconds" && i + 1 < argc) {
+            options.segmentSeconds = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--segment-mb" && i + 1 < argc) {
+            options.segmentMegabytes = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--bench" && i + 1 < argc) {
+            options.benchScene = argv[++i];
+        } else if (arg == "--size" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &options.benchWidth, &options.benchHeight) != 2 ||
+                options.benchWidth < 16 || options.benchHeight < 16) {
+                std::cerr << "Invalid size: " << argv[i] << "\n";
+                options.benchWidth = 1920;
+                options.benchHeight = 1080;
+            }
+        } else if (arg == "--frames" && i + 1 < argc) {
+            options.benchFrames = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            options.baselineFile = argv[++i];
+        } else if (arg == "--write-baseline" && i + 1 < argc) {
+            options.writeBaselineFile = argv[++i];
+        } else if (arg == "--fps-tolerance" && i + 1 < argc) {
+            options.fpsTolerance = std::max(0.0, atof(argv[++i]));
+        } else if (arg == "--scale" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &options.scaleWidth, &options.scaleHeight) != 2 ||
+                options.scaleWidth < 16 || options.scaleHeight < 16) {
+                std::cerr << "Invalid scale: " << argv[i] << "\n";
+                options.scaleWidth = 0;
+                options.scaleHeight = 0;
+            }
+            options.scaleWidth &= ~1;
+            options.scaleHeight &= ~1;
+        } else if (arg == "--scale-quality" && i + 1 < argc) {
+            std::string quality = argv[++i];
+            if (quality == "fast") {
+                options.scaleFlags = SWS_FAST_BILINEAR;
+            } else if (quality == "balanced") {
+                options.scaleFlags = SWS_BILINEAR;
+            } else if (quality == "best") {
+                options.scaleFlags = SWS_LANCZOS;
+            } else {
+                std::cerr << "Unknown scale quality: " << quality << " (fast, balanced, best)\n";
+            }
+        } else if (arg == "--profile" && i + 1 < argc) {
+            std::string name = argv[++i];
+            int index = 0;
+            while (index < ENCODER_PROFILE_COUNT && name != ENCODER_PROFILES[index].name) index++;
+            if (index < ENCODER_PROFILE_COUNT) {
+                options.profile = index;
+            } else {
+                std::cerr << "Unknown profile: " << name << " (realtime, balanced, archival)\n";
+            }
+        } else if (arg == "--adaptive") {
+            options.adaptive = true;
+        } else if (arg == "--audio" && i + 1 < argc) {
+            options.audioSource = argv[++i];
+        } else if (arg == "--bench-audio") {
+            options.benchAudio = true;
+        } else if (arg == "--bench-crash") {
+            options.benchCrash = true;
+        } else if (arg == "--bench-restart") {
+            options.benchRestart = true;
+        } else if (arg == "--lossless") {
+            options.lossless = true;
+        } else if (arg == "--transcode" && i + 1 < argc) {
+            options.transcodeInput = argv[++i];
+        } else if (arg == "--output" && i + 1 < argc) {
+            options.outputName = argv[++i];
+        } else if (arg == "--desktop") {
+            options.desktop = true;
+        } else if (arg == "--region" && i + 1 < argc) {
+            options.hasRegion = sscanf(argv[++i], "%d,%d,%d,%d", &options.regionX, &options.regionY,
+                                       &options.regionWidth, &options.regionHeight) == 4 &&
+                                options.regionWidth >= 16 && options.regionHeight >= 16;
+            if (!options.hasRegion) std::cerr << "Invalid region: " << argv[i] << " (expected x,y,w,h)\n";
+        } else if (arg == "--window" && i + 1 < argc) {
+            options.windowId = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--preview-fps" && i + 1 < argc) {
+            options.previewFps = std::max(0, std::min(TARGET_FPS, atoi(argv[++i])));
+        } else if (arg == "--no-preview-while-recording") {
+            options.previewWhileRecording = false;
+        } else if (arg == "--stats-file" && i + 1 < argc) {
+            options.statsFile = argv[++i];
+        } else if (arg == "--no-cursor") {
+            options.drawCursor = false;
+        } else if (arg == "--headless") {
+            options.headless = true;
+        } else if (arg == "--control" && i + 1 < argc) {
+            options.controlSocket = argv[++i];
+            options.headless = true;
+        } else {
+            std::cerr << "Unknown option: " << arg << "\n";
+        }
+    }
+    return options;
+}
+
+// One X error handler is installed for the whole process before any capture thread starts.
+// A thread that expects a request to fail sets an XErrorTrap for its display; every other
+// error goes to the handler that was there before, so SDL's X errors are never swallowed.
+struct XErrorTrap {
+    Display* display;
+    bool failed;
+};
+
+static thread_local XErrorTrap* activeErrorTrap = nullptr;
+static XErrorHandler previousErrorHandler = nullptr;
+
+static int trapErrorHandler(Display* display, XErrorEvent* event) {
+    if (activeErrorTrap && activeErrorTrap->display == display) {
+        activeErrorTrap->failed = true;
+        return 0;
+    }
+    return previousErrorHandler ? previousErrorHandler(display, event) : 0;
+}
+
+void installErrorTrapHandler() {
+    previousErrorHandler = XSetErrorHandler(trapErrorHandler);
+}
+
+struct TrapXErrors {
+    XErrorTrap trap;
+    XErrorTrap* previous;
+
+    explicit TrapXErrors(Display* display) : trap{display, false}, previous(activeErrorTrap) { activeErrorTrap = &trap; }
+    ~TrapXErrors() { activeErrorTrap = previous; }
+
+    bool failed() {
+        XSync(trap.display, False);
+        return trap.failed;
+    }
+};
+
+bool initShmCapture(ScreenCapture& cap) {
+    if (!XShmQueryExtension(cap.display)) {
+        std::cerr << "MIT-SHM extension not available, using XGetImage\n";
+        return false;
+    }
+
+    int screen = DefaultScreen(cap.display);
+    cap.shmImage = XShmCreateImage(cap.display, DefaultVisual(cap.display, screen),
+                                   DefaultDepth(cap.display, screen), ZPixmap, nullptr,
+                                   &cap.shmInfo, cap.width, cap.height);
+    if (!cap.shmImage) {
+        std::cerr << "XShmCreateImage failed, using XGetImage\n";
+        return false;
+    }
+
+    cap.shmInfo.shmid = shmget(IPC_PRIVATE, cap.shmImage->bytes_per_line * cap.shmImage->height,
+                               IPC_CREAT | 0600);
+    if (cap.shmInfo.shmid < 0) {
+        std::cerr << "shmget failed, using XGetImage\n";
+        XDestroyImage(cap.shmImage);
+        cap.shmImage = nullptr;
+        return false;
+    }
+
+    void* shmaddr = shmat(cap.shmInfo.shmid, nullptr, 0);
+    if (shmaddr == reinterpret_cast<void*>(-1)) {
+        std::cerr << "shmat failed, using XGetImage\n";
+        shmctl(cap.shmInfo.shmid, IPC_RMID, nullptr);
+        XDestroyImage(cap.shmImage);
+        cap.shmImage = nullptr;
+        return false;
+    }
+    cap.shmInfo.shmaddr = cap.shmImage->data = static_cast<char*>(shmaddr);
+    cap.shmInfo.readOnly = False;
+
+    bool attachFailed;
+    {
+        TrapXErrors errors(cap.display);
+        XShmAttach(cap.display, &cap.shmInfo);
+        attachFailed = errors.failed();
+    }
+    shmctl(cap.shmInfo.shmid, IPC_RMID, nullptr);
+
+    if (attachFailed) {
+        std::cerr << "XShmAttach failed, using XGetImage\n";
+        shmdt(cap.shmInfo.shmaddr);
+        cap.shmImage->data = nullptr;
+        XDestroyImage(cap.shmImage);
+        cap.shmImage = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool outputGeometry(Display* display, Window root, const std::string& name,
+                    int& x, int& y, int& width, int& height) {
+    XRRScreenResources* screenRes = XRRGetScreenResources(display, root);
+    if (!screenRes) return false;
+
+    RROutput primaryOutput = XRRGetOutputPrimary(display, root);
+    bool found = false;
+    for (int i = 0; i < screenRes->noutput && !found; ++i) {
+        XRROutputInfo* outputInfo = XRRGetOutputInfo(display, screenRes, screenRes->outputs[i]);
+        if (!outputInfo) continue;
+        bool wanted = name.empty() ? screenRes->outputs[i] == primaryOutput : name == outputInfo->name;
+        if (wanted && outputInfo->crtc) {
+            XRRCrtcInfo* crtcInfo = XRRGetCrtcInfo(display, screenRes, outputInfo->crtc);
+            if (crtcInfo) {
+                x = crtcInfo->x;
+                y = crtcInfo->y;
+                width = crtcInfo->width;
+                height = crtcInfo->height;
+                found = width > 0 && height > 0;
+                XRRFreeCrtcInfo(crtcInfo);
+            }
+        }
+        XRRFreeOutputInfo(outputInfo);
+    }
+    XRRFreeScreenResources(screenRes);
+    return found;
+}
+
+bool windowGeometry(Display* display, Window root, Window window, int& x, int& y, int& width, int& height) {
+    TrapXErrors errors(display);
+    XWindowAttributes attributes;
+    Window child;
+    bool ok = XGetWindowAttributes(display, window, &attributes) &&
+              XTranslateCoordinates(display, window, root, 0, 0, &x, &y, &child);
+    if (errors.failed() || !ok) return false;
+    width = attributes.width;
+    height = attributes.height;
+    return true;
+}
+
+bool resolveCaptureArea(Display* display, Window root, const Options& options,
+                        int& x, int& y, int& width, int& height) {
+    int rootWidth = DisplayWidth(display, DefaultScreen(display));
+    int rootHeight = DisplayHeight(display, DefaultScreen(display));
+
+    if (options.windowId) {
+        if (!windowGeometry(display, root, options.windowId, x, y, width, height)) {
+            std::cerr << "Could not find window 0x" << std::hex << options.windowId << std::dec << "\n";
+            return false;
+        }
+    } else if (options.hasRegion) {
+        x = options.regionX;
+        y = options.regionY;
+        width = options.regionWidth;
+        height = options.regionHeight;
+    } else if (options.desktop) {
+        x = 0;
+        y = 0;
+        width = rootWidth;
+        height = rootHeight;
+    } else if (!outputGeometry(display, root, options.outputName, x, y, width, height)) {
+        if (!options.outputName.empty()) {
+            std::cerr << "Output " << options.outputName << " not found or not active\n";
+            return false;
+        }
+        std::cerr << "Could not get screen resolution, defaulting to 1920x1080\n";
+        x = 0;
+        y = 0;
+        width = std::min(1920, rootWidth);
+        height = std::min(1080, rootHeight);
+    }
+
+    width = std::min(width, rootWidth);
+    height = std::min(height, rootHeight);
+    x = std::max(0, std::min(x, rootWidth - width));
+    y = std::max(0, std::min(y, rootHeight - height));
+    if (width < 16 || height < 16) {
+        std::cerr << "Capture area " << width << "x" << height << " is too small\n";
+        return false;
+    }
+    return true;
+}
+
+void publishCaptureSize(ScreenCapture& cap) {
+    cap.liveSize = static_cast<uint32_t>(cap.width) << 16 | static_cast<uint32_t>(cap.height);
+}
+
+void captureSize(const ScreenCapture& cap, int& width, int& height) {
+    uint32_t size = cap.liveSize;
+    width = static_cast<int>(size >> 16);
+    height = static_cast<int>(size & 0xffff);
+}
+
+void cleanupCapture(ScreenCapture& cap);
+
+bool initCapture(ScreenCapture& cap, Display* display, Window root, Window window,
+                 int x, int y, int width, int height, bool allowShm, bool drawCursor) {
+    cap.display = display;
+    cap.root = root;
+    cap.window = window;
+    cap.rootWidth = DisplayWidth(display, DefaultScreen(display));
+    cap.rootHeight = DisplayHeight(display, DefaultScreen(display));
+    if (window) XSelectInput(display, window, StructureNotifyMask);
+    cap.x = x;
+    cap.y = y;
+    cap.width = width;
+    cap.height = height;
+    publishCaptureSize(cap);
+    cap.windowLost = false;
+    cap.shmImage = nullptr;
+    cap.useShm = allowShm && initShmCapture(cap);
+
+    int errorBase = 0;
+    cap.cursor.enabled = drawCursor && XFixesQueryExtension(display, &cap.cursor.eventBase, &errorBase);
+    if (cap.cursor.enabled) {
+        XFixesSelectCursorInput(display, root, XFixesDisplayCursorNotifyMask);
+        cap.cursor.stale = true;
+    } else if (drawCursor) {
+        std::cerr << "XFixes extension not available, recording without cursor\n";
+    }
+    return true;
+}
+
+void followWindow(ScreenCapture& cap) {
+    int x, y, width, height;
+    if (!windowGeometry(cap.display, cap.root, cap.window, x, y, width, height)) return;
+    width = std::max(16, std::min(width, cap.rootWidth));
+    height = std::max(16, std::min(height, cap.rootHeight));
+    if (width != cap.width || height != cap.height) {
+        bool useShm = cap.useShm;
+        cleanupCapture(cap);
+        cap.width = width;
+        cap.height = height;
+        cap.useShm = useShm && initShmCapture(cap);
+        publishCaptureSize(cap);
+    }
+    cap.x = std::max(0, std::min(x, cap.rootWidth - cap.width));
+    cap.y = std::max(0, std::min(y, cap.rootHeight - cap.height));
+}
+
+void processCaptureEvents(ScreenCapture& cap) {
+    bool moved = false;
+    while (XPending(cap.display)) {
+        XEvent event;
+        XNextEvent(cap.display, &event);
+        if (cap.window && event.type == ConfigureNotify && event.xconfigure.window == cap.window) {
+            moved = true;
+        } else if (cap.window && event.type == DestroyNotify && event.xdestroywindow.window == cap.window) {
+            std::cerr << "Captured window was destroyed\n";
+            cap.window = None;
+            cap.windowLost = true;
+        } else if (cap.cursor.enabled && event.type == cap.cursor.eventBase + XFixesCursorNotify) {
+            const XFixesCursorNotifyEvent& notify = reinterpret_cast<const XFixesCursorNotifyEvent&>(event);
+            if (notify.cursor_serial != cap.cursor.serial) cap.cursor.stale = true;
+        }
+    }
+    if (moved && cap.window) followWindow(cap);
+}
+
+bool updateCursor(ScreenCapture& cap) {
+    CursorImage& cursor = cap.cursor;
+    if (!cursor.enabled) return false;
+
+    if (cursor.stale) {
+        XFixesCursorImage* image = XFixesGetCursorImage(cap.display);
+        if (!image) return false;
+        cursor.serial = image->cursor_serial;
+        cursor.width = image->width;
+        cursor.height = image->height;
+        cursor.hotX = image->xhot;
+        cursor.hotY = image->yhot;
+        cursor.pixels.resize(cursor.width * cursor.height);
+        for (size_t i = 0; i < cursor.pixels.size(); i++) {
+            cursor.pixels[i] = static_cast<uint32_t>(image->pixels[i]);
+        }
+        XFree(image);
+        cursor.stale = false;
+    }
+
+    Window rootReturn, childReturn;
+    int rootX, rootY, windowX, windowY;
+    unsigned int mask;
+    if (!XQueryPointer(cap.display, cap.root, &rootReturn, &childReturn, &rootX, &rootY,
+                       &windowX, &windowY, &mask)) {
+        return false;
+    }
+    cursor.x = rootX - cursor.hotX - cap.x;
+    cursor.y = rootY - cursor.hotY - cap.y;
+    return cursor.width > 0 && cursor.x < cap.width && cursor.y < cap.height &&
+           cursor.x + cursor.width > 0 && cursor.y + cursor.height > 0;
+}
+
+XImage* captureFrame(ScreenCapture& cap) {
+    auto start = std::chrono::steady_clock::now();
+    if (cap.window || cap.cursor.enabled) processCaptureEvents(cap);
+    if (cap.windowLost) return nullptr;
+
+    XImage* img = nullptr;
+    if (cap.useShm) {
+        if (XShmGetImage(cap.display, cap.root, cap.shmImage, cap.x, cap.y, AllPlanes)) {
+            img = cap.shmImage;
+        }
+    } else {
+        img = XGetImage(cap.display, cap.root, cap.x, cap.y, cap.width, cap.height, AllPlanes, ZPixmap);
+    }
+
+    recordStage(PipelineStage::Capture, std::chrono::steady_clock::now() - start);
+    return img;
+}
+
+void releaseFrame(ScreenCapture& cap, XImage* img) {
+    if (img && img != cap.shmImage) XDestroyImage(img);
+}
+
+void cleanupCapture(ScreenCapture& cap) {
+    if (!cap.shmImage) return;
+
+    XShmDetach(cap.display, &cap.shmInfo);
+    XSync(cap.display, False);
+    shmdt(cap.shmInfo.shmaddr);
+    cap.shmImage->data = nullptr;
+    XDestroyImage(cap.shmImage);
+    cap.shmImage = nullptr;
+}
+
+bool initSDL(SDL_Window** window, SDL_Renderer** renderer) {
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        std::cerr << "SDL_Init Error: " << SDL_GetError() << std::endl;
+        return false;
+    }
+
+    if (TTF_Init() == -1) {
+        std::cerr << "TTF_Init Error: " << TTF_GetError() << std::endl;
+        SDL_Quit();
+        return false;
+    }
+
+    *window = SDL_CreateWindow("Wumbo Recorder",
+        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
+    if (!*window) {
+        std::cerr << "Window error: " << SDL_GetError() << std::endl;
+        TTF_Quit();
+        SDL_Quit();
+        return false;
+    }
+
+    *renderer = SDL_CreateRenderer(*window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (!*renderer) {
+        std::cerr << "Renderer error: " << SDL_GetError() << std::endl;
+        SDL_DestroyWindow(*window);
+        TTF_Quit();
+        SDL_Quit();
+        return false;
+    }
+
+    return true;
+}
+
+AVFormatContext* openOutputFile(const std::string& filename, const AVCodecParameters* videoParameters,
+                                AVRational timeBase, AVStream** videoStream,
+                                const AVCodecParameters* audioParameters, AVStream** audioStream,
+                                bool fragmented) {
+    const AVOutputFormat* outputFormat = av_guess_format(nullptr, filename.c_str(), nullptr);
+    if (!outputFormat) outputFormat = av_guess_format(TARGET_FORMAT, nullptr, nullptr);
+    if (!outputFormat) {
+        std::cerr << "Could not find output format for " << filename << "\n";
+        return nullptr;
+    }
+
+    AVFormatContext* formatContext = nullptr;
+    if (avformat_alloc_output_context2(&formatContext, 
+                                     const_cast<AVOutputFormat*>(outputFormat), 
+                                     nullptr, filename.c_str()) < 0) {
+        std::cerr << "Could not create output context\n";
+        return nullptr;
+    }
+
+    *videoStream = avformat_new_stream(formatContext, nullptr);
+    if (!*videoStream) {
+        std::cerr << "Could not create video stream\n";
+        avformat_free_context(formatContext);
+        return nullptr;
+    }
+
+    if (avcodec_parameters_copy((*videoStream)->codecpar, videoParameters) < 0) {
+        std::cerr << "Could not copy video codec parameters\n";
+        avformat_free_context(formatContext);
+        return nullptr;
+    }
+    (*videoStream)->time_base = timeBase;
+
+    *audioStream = nullptr;
+    if (audioParameters) {
+        *audioStream = avformat_new_stream(formatContext, nullptr);
+        if (!*audioStream || avcodec_parameters_copy((*audioStream)->codecpar, audioParameters) < 0) {
+            std::cerr << "Could not create audio stream\n";
+            avformat_free_context(formatContext);
+            return nullptr;
+        }
+        (*audioStream)->time_base = AVRational{1, audioParameters->sample_rate};
+    }
+
+    if (!(formatContext->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&formatContext->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            std::cerr << "Could not open output file\n";
+            avformat_free_context(formatContext);
+            return nullptr;
+        }
+    }
+
+    AVDictionary* muxerOptions = nullptr;
+    if (fragmented) {
+        av_dict_set(&muxerOptions, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        av_dict_set(&muxerOptions, "flush_packets", "1", 0);
+    }
+
+    int ret = avformat_write_header(formatContext, &muxerOptions);
+    av_dict_free(&muxerOptions);
+    if (ret < 0) {
+        std::cerr << "Could not write header\n";
+        if (!(formatContext->oformat->flags & AVFMT_NOFILE)) avio_closep(&formatContext->pb);
+        avformat_free_context(formatContext);
+        return nullptr;
+    }
+
+    return formatContext;
+}
+
+void closeOutputFile(AVFormatContext*& formatContext) {
+    if (!formatContext) return;
+
+    av_write_trailer(formatContext);
+    if (!(formatContext->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&formatContext->pb);
+    }
+    avformat_free_context(formatContext);
+    formatContext = nullptr;
+}
+
+void pushReplayPacket(ReplayBuffer& replay, AVPacket* pkt) {
+    AVPacket* packet = av_packet_alloc();
+    av_packet_move_ref(packet, pkt);
+
+    std::lock_guard<std::mutex> lock(replay.mutex);
+    replay.bytes += packet->size;
+    replay.packets.push_back(packet);
+
+    while (true) {
+        size_t nextKeyframe = 1;
+        while (nextKeyframe < replay.packets.size() &&
+               (replay.packets[nextKeyframe]->stream_index != VIDEO_STREAM_INDEX ||
+                !(replay.packets[nextKeyframe]->flags & AV_PKT_FLAG_KEY))) {
+            nextKeyframe++;
+        }
+        if (nextKeyframe >= replay.packets.size()) break;
+
+        bool tooLong = packet->stream_index == VIDEO_STREAM_INDEX &&
+                       packet->dts - replay.packets[nextKeyframe]->dts >= replay.maxDuration;
+        bool tooLarge = replay.bytes > replay.maxBytes;
+        if (!tooLong && !tooLarge) break;
+
+        for (size_t i = 0; i < nextKeyframe; i++) {
+            AVPacket* oldest = replay.packets.front();
+            replay.bytes -= oldest->size;
+            av_packet_free(&oldest);
+            replay.packets.pop_front();
+        }
+    }
+}
+
+void clearReplayBuffer(ReplayBuffer& replay) {
+    std::lock_guard<std::mutex> lock(replay.mutex);
+    for (AVPacket* packet : replay.packets) av_packet_free(&packet);
+    replay.packets.clear();
+    replay.bytes = 0;
+}
+
+std::string timestampedFilename(const char* prefix, const char* extension = TARGET_FORMAT) {
+    char stamp[32];
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+    return std::string(prefix) + "-" + stamp + "." + extension;
+}
+
+std::string uniqueFilename(const std::string& filename) {
+    std::string base = filename.substr(0, filename.rfind('.'));
+    std::string extension = filename.substr(base.size());
+    std::string candidate = filename;
+    for (int i = 2; access(candidate.c_str(), F_OK) == 0; i++) {
+        candidate = base + "-" + std::to_string(i) + extension;
+    }
+    return candidate;
+}
+
+std::string transcodeFilename(const std::string& spool) {
+    return spool.substr(0, spool.rfind('.')) + "." + TARGET_FORMAT;
+}
+
+// The spool is transcoded next to itself, so both it and its transcode target must be free.
+std::string spoolFilename(const std::string& filename) {
+    std::string base = filename.substr(0, filename.rfind('.'));
+    std::string spool = uniqueFilename(base + ".mkv");
+    for (int i = 2; access(transcodeFilename(spool).c_str(), F_OK) == 0; i++) {
+        spool = uniqueFilename(base + "-" + std::to_string(i) + ".mkv");
+    }
+    return spool;
+}
+
+bool saveReplay(RecordingContext& ctx) {
+    if (!ctx.isInitialized || ctx.replaySeconds <= 0) return false;
+
+    std::vector<AVPacket*> packets;
+    {
+        std::lock_guard<std::mutex> lock(ctx.replay.mutex);
+        for (const AVPacket* packet : ctx.replay.packets) {
+            packets.push_back(av_packet_clone(packet));
+        }
+    }
+    if (packets.empty()) {
+        std::cerr << "Replay buffer is empty\n";
+        return false;
+    }
+
+    auto firstVideo = std::find_if(packets.begin(), packets.end(),
+                                   [](const AVPacket* packet) { return packet->stream_index != AUDIO_STREAM_INDEX; });
+    if (firstVideo == packets.end()) {
+        std::cerr << "Replay buffer holds no video\n";
+        for (AVPacket* packet : packets) av_packet_free(&packet);
+        return false;
+    }
+    int64_t offset = (*firstVideo)->dts;
+
+    std::string filename = uniqueFilename(timestampedFilename("replay"));
+    AVStream* stream = nullptr;
+    AVStream* audioStream = nullptr;
+    AVFormatContext* formatContext = openOutputFile(filename, ctx.videoParameters, VIDEO_TIME_BASE, &stream,
+                                                    ctx.audio.parameters, &audioStream, false);
+    bool saved = formatContext != nullptr;
+    if (formatContext) {
+        for (AVPacket* packet : packets) {
+            bool audio = packet->stream_index == AUDIO_STREAM_INDEX;
+            AVRational timeBase = audio ? AUDIO_TIME_BASE : VIDEO_TIME_BASE;
+            int64_t streamOffset = av_rescale_q(offset, VIDEO_TIME_BASE, timeBase);
+            packet->pts -= streamOffset;
+            packet->dts -= streamOffset;
+            if (audio && (!audioStream || packet->dts < 0)) continue;
+            AVStream* target = audio ? audioStream : stream;
+            av_packet_rescale_ts(packet, timeBase, target->time_base);
+            packet->stream_index = target->index;
+            if (av_interleaved_write_frame(formatContext, packet) < 0) {
+                std::cerr << "Error writing replay packet\n";
+            }
+        }
+        closeOutputFile(formatContext);
+        std::cout << "Saved replay to " << filename << "\n";
+    }
+
+    for (AVPacket* packet : packets) av_packet_free(&packet);
+    return saved;
+}
+
+std::string segmentFilename(const RecordingContext& ctx) {
+    if (ctx.segmentSeconds <= 0 && ctx.segmentMegabytes <= 0) return ctx.filename;
+
+    std::string base = ctx.filename.substr(0, ctx.filename.rfind('.'));
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%03d.", ctx.segmentIndex);
+    return base + suffix + TARGET_FORMAT;
+}
+
+bool shouldRotateSegment(const RecordingContext& ctx, const AVPacket* pkt) {
+    if (!(pkt->flags & AV_PKT_FLAG_KEY)) return false;
+    if (!ctx.formatContext) return true;
+
+    if (ctx.segmentSeconds > 0) {
+        int64_t elapsed = av_rescale_q(pkt->dts - ctx.segmentStartDts,
+                                       VIDEO_TIME_BASE, AVRational{1, 1});
+        if (elapsed >= ctx.segmentSeconds) return true;
+    }
+    if (ctx.segmentMegabytes > 0 && ctx.formatContext->pb) {
+        if (avio_tell(ctx.formatContext->pb) >= static_cast<int64_t>(ctx.segmentMegabytes) * 1024 * 1024) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void endLastChapter(AVFormatContext* formatContext, int64_t end) {
+    if (!formatContext || formatContext->nb_chapters == 0) return;
+    AVChapter* chapter = formatContext->chapters[formatContext->nb_chapters - 1];
+    chapter->end = std::max(chapter->start, end);
+}
+
+bool markChapter(RecordingContext& ctx, const std::string& title, std::string& error) {
+    std::lock_guard<std::mutex> lock(ctx.muxMutex);
+    if (ctx.fragmented) {
+        error = "chapters are not supported with --fragmented: the moov box is written before recording";
+        return false;
+    }
+    if (!ctx.isInitialized || !ctx.formatContext) {
+        error = "no output file to add a chapter to";
+        return false;
+    }
+
+    // Chapters follow what has actually been muxed, not the wall clock, so a backed-up
+    // encoder queue does not push the mark past the frames it refers to.
+    int64_t start = 0;
+    if (ctx.lastVideoDts != AV_NOPTS_VALUE) start = std::max<int64_t>(0, ctx.lastVideoDts - ctx.segmentStartDts);
+    AVFormatContext* formatContext = ctx.formatContext;
+    endLastChapter(formatContext, start);
+
+    AVChapter* chapter = static_cast<AVChapter*>(av_mallocz(sizeof(AVChapter)));
+    if (!chapter) {
+        error = "could not allocate chapter";
+        return false;
+    }
+    chapter->id = formatContext->nb_chapters;
+    chapter->time_base = VIDEO_TIME_BASE;
+    chapter->start = start;
+    chapter->end = start;
+    std::string name = title.empty() ? "Chapter " + std::to_string(formatContext->nb_chapters + 1) : title;
+    av_dict_set(&chapter->metadata, "title", name.c_str(), 0);
+    av_dynarray_add(&formatContext->chapters, reinterpret_cast<int*>(&formatContext->nb_chapters), chapter);
+    return true;
+}
+
+bool rotateSegment(RecordingContext& ctx, const AVPacket* pkt) {
+    endLastChapter(ctx.formatContext, pkt->dts - ctx.segmentStartDts);
+    closeOutputFile(ctx.formatContext);
+    ctx.segmentIndex++;
+    ctx.segmentStartDts = pkt->dts;
+
+    std::string filename = segmentFilename(ctx);
+    ctx.formatContext = openOutputFile(filename, ctx.videoParameters, VIDEO_TIME_BASE, &ctx.videoStream,
+                                       ctx.audio.parameters, &ctx.audioStream, ctx.fragmented);
+    if (!ctx.formatContext) {
+        std::cerr << "Could not open segment " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+void muxPacket(RecordingContext& ctx, AVPacket* pkt) {
+    if (ctx.replaySeconds > 0) {
+        pushReplayPacket(ctx.replay, pkt);
+        return;
+    }
+    if (!ctx.formatContext) return;
+
+    bool audio = pkt->stream_index == AUDIO_STREAM_INDEX;
+    AVRational timeBase = audio ? AUDIO_TIME_BASE : VIDEO_TIME_BASE;
+    if (ctx.segmentIndex > 0) {
+        int64_t offset = av_rescale_q(ctx.segmentStartDts, VIDEO_TIME_BASE, timeBase);
+        pkt->pts -= offset;
+        pkt->dts -= offset;
+        if (audio && pkt->dts < 0) return;
+    }
+
+    AVStream* stream = audio ? ctx.audioStream : ctx.videoStream;
+    if (!stream) return;
+    av_packet_rescale_ts(pkt, timeBase, stream->time_base);
+    pkt->stream_index = stream->index;
+    if (av_interleaved_write_frame(ctx.formatContext, pkt) < 0) {
+        std::cerr << "Error writing " << (audio ? "audio" : "video") << " packet\n";
+    }
+}
+
+void writePendingAudio(RecordingContext& ctx, int64_t videoDts, bool inclusive) {
+    while (!ctx.pendingAudio.empty()) {
+        AVPacket* audio = ctx.pendingAudio.front();
+        int order = av_compare_ts(audio->dts, AUDIO_TIME_BASE, videoDts, VIDEO_TIME_BASE);
+        if (order > 0 || (order == 0 && !inclusive)) break;
+        ctx.pendingAudio.pop_front();
+        muxPacket(ctx, audio);
+        av_packet_free(&audio);
+    }
+}
+
+void flushPendingAudio(RecordingContext& ctx) {
+    std::lock_guard<std::mutex> lock(ctx.muxMutex);
+    for (AVPacket* audio : ctx.pendingAudio) {
+        muxPacket(ctx, audio);
+        av_packet_free(&audio);
+    }
+    ctx.pendingAudio.clear();
+}
+
+void writePacket(RecordingContext& ctx, AVPacket* pkt) {
+    std::lock_guard<std::mutex> lock(ctx.muxMutex);
+    if (pkt->stream_index == AUDIO_STREAM_INDEX) {
+        if (ctx.lastVideoDts != AV_NOPTS_VALUE &&
+            av_compare_ts(pkt->dts, AUDIO_TIME_BASE, ctx.lastVideoDts, VIDEO_TIME_BASE) <= 0) {
+            muxPacket(ctx, pkt);
+        } else {
+            AVPacket* held = av_packet_alloc();
+            av_packet_move_ref(held, pkt);
+            ctx.pendingAudio.push_back(held);
+        }
+        return;
+    }
+
+    writePendingAudio(ctx, pkt->dts, false);
+    if (ctx.replaySeconds <= 0 && shouldRotateSegment(ctx, pkt) && !rotateSegment(ctx, pkt)) return;
+    ctx.lastVideoDts = pkt->dts;
+    muxPacket(ctx, pkt);
+    writePendingAudio(ctx, ctx.lastVideoDts, true);
+}
+
+bool encodeFrame(RecordingContext& ctx, const AVFrame* frame, AVPacket* pkt) {
+    if (avcodec_send_frame(ctx.videoCodecContext, frame) < 0) {
+        std::cerr << "Error sending frame to encoder\n";
+        return false;
+    }
+
+    while (true) {
+        int ret = avcodec_receive_packet(ctx.videoCodecContext, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+        if (ret < 0) {
+            std::cerr << "Error receiving packet\n";
+            return false;
+        }
+
+        writePacket(ctx, pkt);
+        av_packet_unref(pkt);
+    }
+    return true;
+}
+
+int presetLadderIndex(const char* preset) {
+    for (int i = 0; i < PRESET_LADDER_COUNT; i++) {
+        if (strcmp(PRESET_LADDER[i], preset) == 0) return i;
+    }
+    return 0;
+}
+
+AVCodecContext* openH264Encoder(const EncoderProfile& profile, const char* preset, int maxBFrames,
+                                bool globalHeader, bool pinHighProfile, int threads, const AVCodec* videoCodec,
+                                int width, int height) {
+    AVCodecContext* codecContext = avcodec_alloc_context3(videoCodec);
+    if (!codecContext) {
+        std::cerr << "Could not allocate video codec context\n";
+        return nullptr;
+    }
+
+    codecContext->codec_id = AV_CODEC_ID_H264;
+    codecContext->width = width;
+    codecContext->height = height;
+    codecContext->time_base = VIDEO_TIME_BASE;
+    codecContext->framerate = (AVRational){TARGET_FPS, 1};
+    codecContext->gop_size = profile.gopSize;
+    codecContext->max_b_frames = maxBFrames;
+    codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+    codecContext->thread_count = threads;
+    codecContext->thread_type = profile.threadType;
+    if (profile.capBitrate) {
+        codecContext->rc_max_rate = TARGET_BITRATE;
+        codecContext->rc_buffer_size = TARGET_BITRATE;
+    } else {
+        codecContext->bit_rate = TARGET_BITRATE;
+    }
+
+    av_opt_set(codecContext->priv_data, "preset", preset, 0);
+    av_opt_set(codecContext->priv_data, "tune", profile.tune, 0);
+    av_opt_set_int(codecContext->priv_data, "crf", profile.crf, 0);
+    av_opt_set_int(codecContext->priv_data, "forced-idr", 1, 0);
+    if (profile.lookahead >= 0) {
+        av_opt_set_int(codecContext->priv_data, "rc-lookahead", profile.lookahead, 0);
+    }
+    if (pinHighProfile) {
+        // ultrafast and superfast turn off CABAC and 8x8 transforms, which would drop the
+        // in-band SPS to a lower profile than the one the MP4 track declared.
+        av_opt_set(codecContext->priv_data, "profile", "high", 0);
+        av_opt_set(codecContext->priv_data, "coder", "cabac", 0);
+        av_opt_set_int(codecContext->priv_data, "8x8dct", 1, 0);
+    }
+
+    if (globalHeader) {
+        codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(codecContext, videoCodec, nullptr) < 0) {
+        std::cerr << "Could not open video codec\n";
+        avcodec_free_context(&codecContext);
+        return nullptr;
+    }
+    return codecContext;
+}
+
+AVCodecContext* openSpoolEncoder(const AVCodec* videoCodec, int width, int height) {
+    AVCodecContext* codecContext = avcodec_alloc_context3(videoCodec);
+    if (!codecContext) {
+        std::cerr << "Could not allocate video codec context\n";
+        return nullptr;
+    }
+
+    codecContext->codec_id = AV_CODEC_ID_FFV1;
+    codecContext->width = width;
+    codecContext->height = height;
+    codecContext->time_base = VIDEO_TIME_BASE;
+    codecContext->framerate = (AVRational){TARGET_FPS, 1};
+    codecContext->gop_size = 1;
+    codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+    codecContext->level = 3;
+    codecContext->slices = 16;
+    codecContext->thread_count = 0;
+    codecContext->thread_type = FF_THREAD_SLICE;
+    codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    av_opt_set_int(codecContext->priv_data, "slicecrc", 0, 0);
+    av_opt_set_int(codecContext->priv_data, "context", 0, 0);
+
+    if (avcodec_open2(codecContext, videoCodec, nullptr) < 0) {
+        std::cerr << "Could not open spool codec\n";
+        avcodec_free_context(&codecContext);
+        return nullptr;
+    }
+    return codecContext;
+}
+
+AVCodecContext* openVideoEncoder(const RecordingContext& ctx, const AVCodec* videoCodec, int width, int height) {
+    if (ctx.lossless) return openSpoolEncoder(videoCodec, width, height);
+
+    const AVOutputFormat* outputFormat = av_guess_format(TARGET_FORMAT, nullptr, nullptr);
+    bool globalHeader = !ctx.adaptive && outputFormat && (outputFormat->flags & AVFMT_GLOBALHEADER);
+    return openH264Encoder(*ctx.profile, PRESET_LADDER[ctx.presetIndex], ctx.adaptive ? 0 : ctx.profile->maxBFrames,
+                           globalHeader, ctx.adaptive, 0, videoCodec, width, height);
+}
+
+void adaptEncoder(RecordingContext& ctx, AVPacket* pkt) {
+    int depth = telemetry.queueDepth.load(std::memory_order_relaxed);
+    ctx.gopMaxQueueDepth = std::max(ctx.gopMaxQueueDepth, depth);
+    if (++ctx.gopFrames < ctx.profile->gopSize) return;
+
+    // Step to a faster preset as soon as the queue backs up, but only back to a slower one
+    // after several idle GOPs, and never twice within a few seconds, so a load that sits
+    // near the threshold does not flap between presets.
+    int presetIndex = ctx.presetIndex;
+    ctx.idleGops = ctx.gopMaxQueueDepth == 0 ? ctx.idleGops + 1 : 0;
+    if (ctx.gopMaxQueueDepth >= static_cast<int>(MAX_QUEUED_FRAMES) / 2) {
+        presetIndex = std::max(ctx.minPresetIndex, presetIndex - 1);
+    } else if (ctx.idleGops >= ADAPT_IDLE_GOPS) {
+        presetIndex = std::min(ctx.maxPresetIndex, presetIndex + 1);
+    }
+    ctx.gopFrames = 0;
+    ctx.gopMaxQueueDepth = 0;
+    if (presetIndex == ctx.presetIndex) return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - ctx.lastPresetSwitch < std::chrono::seconds(ADAPT_MIN_SWITCH_SECONDS)) return;
+
+    int previousIndex = ctx.presetIndex;
+    ctx.presetIndex = presetIndex;
+    AVCodecContext* codecContext = openVideoEncoder(ctx, ctx.videoCodecContext->codec,
+                                                    ctx.videoCodecContext->width, ctx.videoCodecContext->height);
+    if (!codecContext) {
+        ctx.presetIndex = previousIndex;
+        return;
+    }
+    ctx.idleGops = 0;
+    ctx.lastPresetSwitch = now;
+    encodeFrame(ctx, nullptr, pkt);
+    avcodec_free_context(&ctx.videoCodecContext);
+    ctx.videoCodecContext = codecContext;
+    std::cout << "Encoder preset " << PRESET_LADDER[previousIndex] << " -> "
+              << PRESET_LADDER[ctx.presetIndex] << "\n";
+}
+
+void releaseFrameSlot(RecordingContext& ctx, int slot) {
+    std::lock_guard<std::mutex> lock(ctx.queueMutex);
+    ctx.frameSlots[slot].users--;
+}
+
+void encoderLoop(RecordingContext& ctx) {
+    AVPacket* pkt = av_packet_alloc();
+
+    while (true) {
+        QueuedFrame queued;
+        {
+            std::unique_lock<std::mutex> lock(ctx.queueMutex);
+            ctx.queueCond.wait(lock, [&ctx] { return !ctx.frameQueue.empty() || ctx.stopEncoder; });
+            if (ctx.frameQueue.empty()) break;
+            queued = ctx.frameQueue.front();
+            ctx.frameQueue.erase(ctx.frameQueue.begin());
+            recordQueueDepth(static_cast<int>(ctx.frameQueue.size()));
+        }
+
+        if (ctx.adaptive) adaptEncoder(ctx, pkt);
+        queued.frame->pts = queued.pts;
+        queued.frame->pict_type = queued.keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        {
+            StageTimer timer(PipelineStage::Encode);
+            encodeFrame(ctx, queued.frame, pkt);
+        }
+        releaseFrameSlot(ctx, queued.slot);
+    }
+
+    encodeFrame(ctx, nullptr, pkt);
+    av_packet_free(&pkt);
+}
+
+struct SineAudioSource : AudioSource {
+    bool paced;
+    double phase = 0.0;
+    int64_t framesRead = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    explicit SineAudioSource(bool paced) : paced(paced) {}
+
+    int read(int16_t* samples, int frames) override {
+        if (paced) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds((framesRead + frames) * 1000000 / sampleRate));
+        }
+        for (int i = 0; i < frames; i++) {
+            int16_t value = static_cast<int16_t>(std::sin(phase) * 8000);
+            phase += 2 * M_PI * 440.0 / sampleRate;
+            if (phase > 2 * M_PI) phase -= 2 * M_PI;
+            for (int c = 0; c < channels; c++) samples[i * channels + c] = value;
+        }
+        framesRead += frames;
+        return frames;
+    }
+};
+
+struct WavAudioSource : AudioSource {
+    std::ifstream file;
+    std::streampos dataStart;
+    uint32_t dataSize = 0;
+    uint32_t dataRead = 0;
+    int64_t framesRead = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    bool open(const std::string& path) {
+        file.open(path, std::ios::binary);
+        char riff[12];
+        if (!file.read(riff, sizeof(riff)) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+            std::cerr << "Not a WAV file: " << path << "\n";
+            return false;
+        }
+
+        uint16_t format = 0, bits = 0;
+        char header[8];
+        while (file.read(header, sizeof(header))) {
+            uint32_t size;
+            memcpy(&size, header + 4, 4);
+            if (memcmp(header, "fmt ", 4) == 0 && size >= 16) {
+                char fmt[16];
+                file.read(fmt, sizeof(fmt));
+                uint16_t channelCount;
+                uint32_t rate;
+                memcpy(&format, fmt, 2);
+                memcpy(&channelCount, fmt + 2, 2);
+                memcpy(&rate, fmt + 4, 4);
+                memcpy(&bits, fmt + 14, 2);
+                channels = channelCount;
+                sampleRate = static_cast<int>(rate);
+                file.seekg(size - 16 + (size & 1), std::ios::cur);
+            } else if (memcmp(header, "data", 4) == 0) {
+                dataStart = file.tellg();
+                dataSize = size;
+                break;
+            } else {
+                file.seekg(size + (size & 1), std::ios::cur);
+            }
+        }
+
+        if (format != 1 || bits != 16 || channels < 1 || channels > AUDIO_CHANNELS || dataSize == 0) {
+            std::cerr << "Unsupported WAV file (need 16-bit PCM, mono or stereo): " << path << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    int read(int16_t* samples, int frames) override {
+        std::this_thread::sleep_until(start + std::chrono::microseconds((framesRead + frames) * 1000000 / sampleRate));
+        uint32_t frameBytes = channels * sizeof(int16_t);
+        char* out = reinterpret_cast<char*>(samples);
+        uint32_t wanted = frames * frameBytes;
+        while (wanted > 0) {
+            if (dataRead + frameBytes > dataSize) {
+                file.clear();
+                file.seekg(dataStart);
+                dataRead = 0;
+            }
+            uint32_t bytes = std::min(wanted, (dataSize - dataRead) / frameBytes * frameBytes);
+            if (!file.read(out, bytes)) return -1;
+            out += bytes;
+            wanted -= bytes;
+            dataRead += bytes;
+        }
+        framesRead += frames;
+        return frames;
+    }
+};
+
+#if WITH_ALSA
+struct AlsaAudioSource : AudioSource {
+    snd_pcm_t* pcm = nullptr;
+
+    ~AlsaAudioSource() override {
+        if (pcm) snd_pcm_close(pcm);
+    }
+
+    bool open(const std::string& device) {
+        int err = snd_pcm_open(&pcm, device.c_str(), SND_PCM_STREAM_CAPTURE, 0);
+        if (err < 0) {
+            std::cerr << "Could not open ALSA device " << device << ": " << snd_strerror(err) << "\n";
+            pcm = nullptr;
+            return false;
+        }
+        err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                 channels, sampleRate, 1, 100000);
+        if (err < 0) {
+            std::cerr << "Could not configure ALSA device " << device << ": " << snd_strerror(err) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    int read(int16_t* samples, int frames) override {
+        snd_pcm_sframes_t got = snd_pcm_readi(pcm, samples, frames);
+        if (got < 0) {
+            return snd_pcm_recover(pcm, static_cast<int>(got), 1) < 0 ? -1 : 0;
+        }
+        return static_cast<int>(got);
+    }
+
+    int64_t delayFrames() override {
+        snd_pcm_sframes_t delay = 0;
+        return snd_pcm_delay(pcm, &delay) < 0 ? 0 : delay;
+    }
+};
+#endif
+
+std::unique_ptr<AudioSource> createAudioSource(const std::string& spec) {
+    if (spec == "sine") {
+        return std::unique_ptr<AudioSource>(new SineAudioSource(true));
+    }
+    if (spec.compare(0, 4, "wav:") == 0) {
+        std::unique_ptr<WavAudioSource> source(new WavAudioSource());
+        if (!source->open(spec.substr(4))) return nullptr;
+        return source;
+    }
+    if (spec == "alsa" || spec.compare(0, 5, "alsa:") == 0) {
+#if WITH_ALSA
+        std::unique_ptr<AlsaAudioSource> source(new AlsaAudioSource());
+        if (!source->open(spec == "alsa" ? "default" : spec.substr(5))) return nullptr;
+        return source;
+#else
+        std::cerr << "ALSA capture was not compiled in (built with WITH_ALSA=0)\n";
+        return nullptr;
+#endif
+    }
+    std::cerr << "Unknown audio source: " << spec << " (alsa[:DEVICE], sine, wav:PATH)\n";
+    return nullptr;
+}
+
+bool pushAudioChunk(AudioRing& ring, const AudioChunk& chunk) {
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    size_t tail = ring.tail.load(std::memory_order_acquire);
+    if (head - tail >= ring.chunks.size()) return false;
+    ring.chunks[head % ring.chunks.size()] = chunk;
+    ring.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool popAudioChunk(AudioRing& ring, AudioChunk& chunk) {
+    size_t tail = ring.tail.load(std::memory_order_relaxed);
+    size_t head = ring.head.load(std::memory_order_acquire);
+    if (tail == head) return false;
+    chunk = ring.chunks[tail % ring.chunks.size()];
+    ring.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool openAudioPipeline(AudioPipeline& audio) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!codec) {
+        std::cerr << "AAC codec not found\n";
+        return false;
+    }
+
+    audio.codecContext = avcodec_alloc_context3(codec);
+    if (!audio.codecContext) {
+        std::cerr << "Could not allocate audio codec context\n";
+        return false;
+    }
+    AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+    av_channel_layout_copy(&audio.codecContext->ch_layout, &stereo);
+    audio.codecContext->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    audio.codecContext->sample_rate = AUDIO_SAMPLE_RATE;
+    audio.codecContext->bit_rate = AUDIO_BITRATE;
+    audio.codecContext->time_base = AUDIO_TIME_BASE;
+
+    const AVOutputFormat* outputFormat = av_guess_format(TARGET_FORMAT, nullptr, nullptr);
+    if (outputFormat && (outputFormat->flags & AVFMT_GLOBALHEADER)) {
+        audio.codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(audio.codecContext, codec, nullptr) < 0) {
+        std::cerr << "Could not open audio codec\n";
+        return false;
+    }
+
+    audio.parameters = avcodec_parameters_alloc();
+    if (!audio.parameters || avcodec_parameters_from_context(audio.parameters, audio.codecContext) < 0) {
+        std::cerr << "Could not copy audio codec parameters\n";
+        return false;
+    }
+
+    AVChannelLayout inputLayout;
+    av_channel_layout_default(&inputLayout, audio.source->channels);
+    if (swr_alloc_set_opts2(&audio.swrContext, &audio.codecContext->ch_layout, AV_SAMPLE_FMT_FLTP,
+                            AUDIO_SAMPLE_RATE, &inputLayout, AV_SAMPLE_FMT_S16,
+                            audio.source->sampleRate, 0, nullptr) < 0) {
+        std::cerr << "Could not allocate resampler\n";
+        return false;
+    }
+    av_opt_set_double(audio.swrContext, "min_comp", 0.01, 0);
+    av_opt_set_double(audio.swrContext, "max_soft_comp", 0.01, 0);
+    if (swr_init(audio.swrContext) < 0) {
+        std::cerr << "Could not initialize resampler\n";
+        return false;
+    }
+
+    int frameSize = audio.codecContext->frame_size;
+    audio.fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, AUDIO_CHANNELS, frameSize * 4);
+    audio.frame = av_frame_alloc();
+    if (!audio.fifo || !audio.frame) {
+        std::cerr << "Could not allocate audio buffers\n";
+        return false;
+    }
+    audio.frame->nb_samples = frameSize;
+    audio.frame->format = AV_SAMPLE_FMT_FLTP;
+    audio.frame->sample_rate = AUDIO_SAMPLE_RATE;
+    av_channel_layout_copy(&audio.frame->ch_layout, &audio.codecContext->ch_layout);
+    if (av_frame_get_buffer(audio.frame, 0) < 0) {
+        std::cerr << "Could not allocate audio frame\n";
+        return false;
+    }
+
+    audio.ring.chunks.resize(AUDIO_RING_CHUNKS);
+    audio.ring.head = 0;
+    audio.ring.tail = 0;
+    audio.nextPts = 0;
+    audio.started = false;
+    audio.overruns = 0;
+    return true;
+}
+
+void closeAudioPipeline(AudioPipeline& audio) {
+    if (audio.codecContext) avcodec_free_context(&audio.codecContext);
+    if (audio.parameters) avcodec_parameters_free(&audio.parameters);
+    if (audio.swrContext) swr_free(&audio.swrContext);
+    if (audio.fifo) av_audio_fifo_free(audio.fifo);
+    if (audio.frame) av_frame_free(&audio.frame);
+    audio.fifo = nullptr;
+    audio.source.reset();
+    audio.ring.chunks.clear();
+}
+
+bool resampleAudioChunk(AudioPipeline& audio, const AudioChunk& chunk) {
+    int64_t inputRate = audio.source->sampleRate;
+    int64_t pts = av_rescale(chunk.captureMicros, inputRate * AUDIO_SAMPLE_RATE, 1000000);
+    int64_t outputPts = swr_next_pts(audio.swrContext, pts);
+    if (!audio.started) {
+        audio.nextPts = outputPts / inputRate;
+        audio.started = true;
+    }
+
+    int capacity = swr_get_out_samples(audio.swrContext, chunk.frames);
+    uint8_t* planes[AUDIO_CHANNELS];
+    for (int c = 0; c < AUDIO_CHANNELS; c++) {
+        audio.planes[c].resize(capacity);
+        planes[c] = reinterpret_cast<uint8_t*>(audio.planes[c].data());
+    }
+    const uint8_t* input[1] = { reinterpret_cast<const uint8_t*>(chunk.samples) };
+    int converted = swr_convert(audio.swrContext, planes, capacity, input, chunk.frames);
+    if (converted < 0) {
+        std::cerr << "Error resampling audio\n";
+        return false;
+    }
+    return av_audio_fifo_write(audio.fifo, reinterpret_cast<void**>(planes), converted) == converted;
+}
+
+void sendAudioFrame(RecordingContext& ctx, const AVFrame* frame, AVPacket* pkt) {
+    if (avcodec_send_frame(ctx.audio.codecContext, frame) < 0) {
+        std::cerr << "Error sending frame to audio encoder\n";
+        return;
+    }
+    while (avcodec_receive_packet(ctx.audio.codecContext, pkt) == 0) {
+        pkt->stream_index = AUDIO_STREAM_INDEX;
+        writePacket(ctx, pkt);
+        av_packet_unref(pkt);
+    }
+}
+
+void encodeAudioFifo(RecordingContext& ctx, AVPacket* pkt, bool flush) {
+    AudioPipeline& audio = ctx.audio;
+    int frameSize = audio.codecContext->frame_size;
+    while (av_audio_fifo_size(audio.fifo) >= frameSize || (flush && av_audio_fifo_size(audio.fifo) > 0)) {
+        audio.frame->nb_samples = frameSize;
+        if (av_frame_make_writable(audio.frame) < 0) return;
+        int samples = av_audio_fifo_read(audio.fifo, reinterpret_cast<void**>(audio.frame->data), frameSize);
+        audio.frame->nb_samples = samples;
+        audio.frame->pts = audio.nextPts;
+        audio.nextPts += samples;
+        sendAudioFrame(ctx, audio.frame, pkt);
+    }
+    if (flush) sendAudioFrame(ctx, nullptr, pkt);
+}
+
+void audioCaptureLoop(RecordingContext& ctx) {
+    AudioPipeline& audio = ctx.audio;
+    AudioChunk chunk;
+    while (!audio.stop) {
+        int frames = audio.source->read(chunk.samples, AUDIO_CHUNK_FRAMES);
+        if (frames < 0) {
+            std::cerr << "Audio capture stopped\n";
+            break;
+        }
+        if (frames == 0) continue;
+
+        auto now = std::chrono::steady_clock::now();
+        int64_t delay = audio.source->delayFrames();
+        chunk.frames = frames;
+        chunk.captureMicros = std::chrono::duration_cast<std::chrono::microseconds>(now - ctx.startTime).count() -
+                              (frames + delay) * 1000000 / audio.source->sampleRate;
+        if (chunk.captureMicros < 0) continue;
+        if (!pushAudioChunk(audio.ring, chunk)) audio.overruns++;
+    }
+    audio.captureDone = true;
+}
+
+void audioEncoderLoop(RecordingContext& ctx) {
+    AudioPipeline& audio = ctx.audio;
+    AVPacket* pkt = av_packet_alloc();
+    AudioChunk chunk;
+    while (true) {
+        if (popAudioChunk(audio.ring, chunk)) {
+            if (resampleAudioChunk(audio, chunk)) encodeAudioFifo(ctx, pkt, false);
+        } else if (audio.captureDone) {
+            break;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+    encodeAudioFifo(ctx, pkt, true);
+    av_packet_free(&pkt);
+}
+
+void startAudioPipeline(RecordingContext& ctx) {
+    ctx.audio.stop = false;
+    ctx.audio.captureDone = false;
+    ctx.audio.captureThread = std::thread(audioCaptureLoop, std::ref(ctx));
+    ctx.audio.encoderThread = std::thread(audioEncoderLoop, std::ref(ctx));
+}
+
+void stopAudioPipeline(RecordingContext& ctx) {
+    ctx.audio.stop = true;
+    if (ctx.audio.captureThread.joinable()) ctx.audio.captureThread.join();
+    if (ctx.audio.encoderThread.joinable()) ctx.audio.encoderThread.join();
+}
+
+bool finalizeRecording(RecordingContext& ctx) {
+    if (!ctx.isInitialized) return false;
+
+    {
+        std::lock_guard<std::mutex> lock(ctx.queueMutex);
+        if (ctx.lastSlot >= 0 && ctx.lastSkippedPts > ctx.lastPts) {
+            ctx.frameQueue.push_back({ctx.frameSlots[ctx.lastSlot].frame, ctx.lastSlot, ctx.lastSkippedPts, false});
+            ctx.frameSlots[ctx.lastSlot].users++;
+        }
+        ctx.stopEncoder = true;
+    }
+    ctx.queueCond.notify_all();
+    if (ctx.encoderThread.joinable()) ctx.encoderThread.join();
+    stopAudioPipeline(ctx);
+    flushPendingAudio(ctx);
+
+    endLastChapter(ctx.formatContext, std::max(ctx.lastPts, ctx.lastSkippedPts) + 1 - ctx.segmentStartDts);
+    closeOutputFile(ctx.formatContext);
+
+    std::cout << "Recorded " << ctx.capturedFrames << " frames: "
+              << ctx.lateFrames << " late, "
+              << ctx.duplicatedFrames << " duplicated, "
+              << ctx.droppedFrames << " dropped";
+    if (ctx.deduplicate && ctx.capturedFrames > 0) {
+        std::cout << ", " << ctx.skippedFrames << " unchanged frames skipped ("
+                  << 100 * ctx.skippedFrames / ctx.capturedFrames << "%)";
+    }
+    if (ctx.audio.overruns > 0) {
+        std::cout << ", " << ctx.audio.overruns << " audio chunks lost";
+    }
+    std::cout << "\n";
+
+    return true;
+}
+
+CachedText* cachedText(TextCache& cache, SDL_Renderer* renderer, TTF_Font* font,
+                       const std::string& text, SDL_Color color) {
+    cache.uses++;
+    for (CachedText& entry : cache.entries) {
+        if (entry.font == font && entry.text == text && entry.color.r == color.r &&
+            entry.color.g == color.g && entry.color.b == color.b && entry.color.a == color.a) {
+            entry.lastUsed = cache.uses;
+            return &entry;
+        }
+    }
+
+    SDL_Surface* surface = TTF_RenderText_Solid(font, text.c_str(), color);
+    if (!surface) return nullptr;
+    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
+    CachedText created = {font, text, color, texture, surface->w, surface->h, cache.uses};
+    SDL_FreeSurface(surface);
+    if (!texture) return nullptr;
+
+    if (cache.entries.size() >= TEXT_CACHE_ENTRIES) {
+        auto oldest = std::min_element(cache.entries.begin(), cache.entries.end(),
+                                       [](const CachedText& a, const CachedText& b) {
+                                           return a.lastUsed < b.lastUsed;
+                                       });
+        SDL_DestroyTexture(oldest->texture);
+        *oldest = created;
+        return &*oldest;
+    }
+    cache.entries.push_back(created);
+    return &cache.entries.back();
+}
+
+uint64_t threadCpuMicros() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return static_cast<uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+void clearTextCache(TextCache& cache) {
+    for (CachedText& entry : cache.entries) {
+        SDL_DestroyTexture(entry.texture);
+    }
+    cache.entries.clear();
+}
+
+void drawButton(SDL_Renderer* renderer, Button& button, TTF_Font* font, TextCache& textCache) {
+    SDL_SetRenderDrawColor(renderer, 
+        button.isHovered ? BUTTON_HOVER_COLOR.r : BUTTON_COLOR.r,
+        button.isHovered ? BUTTON_HOVER_COLOR.g : BUTTON_COLOR.g,
+        button.isHovered ? BUTTON_HOVER_COLOR.b : BUTTON_COLOR.b,
+        255);
+    SDL_RenderFillRect(renderer, &button.rect);
+
+    SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
+    SDL_RenderDrawRect(renderer, &button.rect);
+
+    CachedText* text = cachedText(textCache, renderer, font, button.label, BUTTON_TEXT_COLOR);
+    if (text) {
+        SDL_Rect textRect = {
+            button.rect.x + (button.rect.w - text->width) / 2,
+            button.rect.y + (button.rect.h - text->height) / 2,
+            text->width,
+            text->height
+        };
+        SDL_RenderCopy(renderer, text->texture, NULL, &textRect);
+    }
+}
+
+struct ConverterVariant {
+    const char* name;
+    ConvertRowPairFn convert;
+    bool supported;
+};
+
+inline uint8_t rgbToY(int r, int g, int b) {
+    return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+inline uint8_t rgbToU(int r, int g, int b) {
+    return static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+inline uint8_t rgbToV(int r, int g, int b) {
+    return static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+void convertRowPairScalarFrom(int startX, const uint8_t* row0, const uint8_t* row1, int width,
+                              const PixelLayout& layout, uint8_t* y0, uint8_t* y1,
+                              uint8_t* u, uint8_t* v) {
+    const uint32_t* src0 = reinterpret_cast<const uint32_t*>(row0);
+    const uint32_t* src1 = reinterpret_cast<const uint32_t*>(row1);
+
+    for (int x = startX; x < width; x += 2) {
+        int x1 = (x + 1 < width) ? x + 1 : x;
+        const uint32_t pixels[4] = { src0[x], src0[x1], src1[x], src1[x1] };
+        int sumR = 0, sumG = 0, sumB = 0;
+        uint8_t luma[4];
+
+        for (int i = 0; i < 4; i++) {
+            int r = (pixels[i] >> layout.redShift) & 0xff;
+            int g = (pixels[i] >> layout.greenShift) & 0xff;
+            int b = (pixels[i] >> layout.blueShift) & 0xff;
+            luma[i] = rgbToY(r, g, b);
+            sumR += r;
+            sumG += g;
+            sumB += b;
+        }
+
+        y0[x] = luma[0];
+        y1[x] = luma[2];
+        if (x1 != x) {
+            y0[x1] = luma[1];
+            y1[x1] = luma[3];
+        }
+
+        int r = (sumR + 2) >> 2;
+        int g = (sumG + 2) >> 2;
+        int b = (sumB + 2) >> 2;
+        u[x / 2] = rgbToU(r, g, b);
+        v[x / 2] = rgbToV(r, g, b);
+    }
+}
+
+void convertRowPairScalar(const uint8_t* row0, const uint8_t* row1, int width,
+                          const PixelLayout& layout, uint8_t* y0, uint8_t* y1,
+                          uint8_t* u, uint8_t* v) {
+    convertRowPairScalarFrom(0, row0, row1, width, layout, y0, y1, u, v);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline __m128i extractChannelSSE2(__m128i p0, __m128i p1, __m128i shift) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i c0 = _mm_and_si128(_mm_srl_epi32(p0, shift), mask);
+    __m128i c1 = _mm_and_si128(_mm_srl_epi32(p1, shift), mask);
+    return _mm_packs_epi32(c0, c1);
+}
+
+static inline __m128i lumaSSE2(__m128i r, __m128i g, __m128i b) {
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+    y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(y, _mm_set1_epi16(16));
+}
+
+static inline __m128i chromaSSE2(__m128i r, __m128i g, __m128i b, short cr, short cg, short cb) {
+    __m128i c = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+    c = _mm_add_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+    c = _mm_srai_epi16(_mm_add_epi16(c, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(c, _mm_set1_epi16(128));
+}
+
+static inline __m128i average2x2SSE2(__m128i top0, __m128i top1, __m128i bottom0, __m128i bottom1) {
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i sum0 = _mm_madd_epi16(_mm_add_epi16(top0, bottom0), ones);
+    __m128i sum1 = _mm_madd_epi16(_mm_add_epi16(top1, bottom1), ones);
+    __m128i sum = _mm_packs_epi32(sum0, sum1);
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+void convertRowPairSSE2(const uint8_t* row0, const uint8_t* row1, int width,
+                        const PixelLayout& layout, uint8_t* y0, uint8_t* y1,
+                        uint8_t* u, uint8_t* v) {
+    const __m128i rShift = _mm_cvtsi32_si128(layout.redShift);
+    const __m128i gShift = _mm_cvtsi32_si128(layout.greenShift);
+    const __m128i bShift = _mm_cvtsi32_si128(layout.blueShift);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r[2][2], g[2][2], b[2][2];
+        const uint8_t* rows[2] = { row0, row1 };
+        uint8_t* lumaRows[2] = { y0, y1 };
+
+        for (int row = 0; row < 2; row++) {
+            const __m128i* src = reinterpret_cast<const __m128i*>(rows[row] + x * 4);
+            for (int half = 0; half < 2; half++) {
+                __m128i p0 = _mm_loadu_si128(src + half * 2);
+                __m128i p1 = _mm_loadu_si128(src + half * 2 + 1);
+                r[row][half] = extractChannelSSE2(p0, p1, rShift);
+                g[row][half] = extractChannelSSE2(p0, p1, gShift);
+                b[row][half] = extractChannelSSE2(p0, p1, bShift);
+            }
+            __m128i luma = _mm_packus_epi16(lumaSSE2(r[row][0], g[row][0], b[row][0]),
+                                            lumaSSE2(r[row][1], g[row][1], b[row][1]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lumaRows[row] + x), luma);
+        }
+
+        __m128i avgR = average2x2SSE2(r[0][0], r[0][1], r[1][0], r[1][1]);
+        __m128i avgG = average2x2SSE2(g[0][0], g[0][1], g[1][0], g[1][1]);
+        __m128i avgB = average2x2SSE2(b[0][0], b[0][1], b[1][0], b[1][1]);
+        __m128i cb = chromaSSE2(avgR, avgG, avgB, -38, -74, 112);
+        __m128i cr = chromaSSE2(avgR, avgG, avgB, 112, -94, -18);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(u + x / 2), _mm_packus_epi16(cb, cb));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(v + x / 2), _mm_packus_epi16(cr, cr));
+    }
+
+    convertRowPairScalarFrom(x, row0, row1, width, layout, y0, y1, u, v);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i extractChannelAVX2(__m256i p0, __m256i p1, __m128i shift) {
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    __m256i c0 = _mm256_and_si256(_mm256_srl_epi32(p0, shift), mask);
+    __m256i c1 = _mm256_and_si256(_mm256_srl_epi32(p1, shift), mask);
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(c0, c1), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lumaAVX2(__m256i r, __m256i g, __m256i b) {
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+    y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+    return _mm256_add_epi16(y, _mm256_set1_epi16(16));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chromaAVX2(__m256i r, __m256i g, __m256i b, short cr, short cg, short cb) {
+    __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(cr)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(cg)));
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(b, _mm256_set1_epi16(cb)));
+    c = _mm256_srai_epi16(_mm256_add_epi16(c, _mm256_set1_epi16(128)), 8);
+    return _mm256_add_epi16(c, _mm256_set1_epi16(128));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i average2x2AVX2(__m256i top0, __m256i top1, __m256i bottom0, __m256i bottom1) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum0 = _mm256_madd_epi16(_mm256_add_epi16(top0, bottom0), ones);
+    __m256i sum1 = _mm256_madd_epi16(_mm256_add_epi16(top1, bottom1), ones);
+    __m256i sum = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum0, sum1), 0xd8);
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i packChromaAVX2(__m256i c) {
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(c, c), 0xd8);
+    return _mm256_castsi256_si128(packed);
+}
+
+__attribute__((target("avx2")))
+void convertRowPairAVX2(const uint8_t* row0, const uint8_t* row1, int width,
+                        const PixelLayout& layout, uint8_t* y0, uint8_t* y1,
+                        uint8_t* u, uint8_t* v) {
+    const __m128i rShift = _mm_cvtsi32_si128(layout.redShift);
+    const __m128i gShift = _mm_cvtsi32_si128(layout.greenShift);
+    const __m128i bShift = _mm_cvtsi32_si128(layout.blueShift);
+
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i r[2][2], g[2][2], b[2][2];
+        const uint8_t* rows[2] = { row0, row1 };
+        uint8_t* lumaRows[2] = { y0, y1 };
+
+        for (int row = 0; row < 2; row++) {
+            const __m256i* src = reinterpret_cast<const __m256i*>(rows[row] + x * 4);
+            for (int half = 0; half < 2; half++) {
+                __m256i p0 = _mm256_loadu_si256(src + half * 2);
+                __m256i p1 = _mm256_loadu_si256(src + half * 2 + 1);
+                r[row][half] = extractChannelAVX2(p0, p1, rShift);
+                g[row][half] = extractChannelAVX2(p0, p1, gShift);
+                b[row][half] = extractChannelAVX2(p0, p1, bShift);
+            }
+            __m256i luma = _mm256_packus_epi16(lumaAVX2(r[row][0], g[row][0], b[row][0]),
+                                               lumaAVX2(r[row][1], g[row][1], b[row][1]));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(lumaRows[row] + x),
+                                _mm256_permute4x64_epi64(luma, 0xd8));
+        }
+
+        __m256i avgR = average2x2AVX2(r[0][0], r[0][1], r[1][0], r[1][1]);
+        __m256i avgG = average2x2AVX2(g[0][0], g[0][1], g[1][0], g[1][1]);
+        __m256i avgB = average2x2AVX2(b[0][0], b[0][1], b[1][0], b[1][1]);
+        __m256i cb = chromaAVX2(avgR, avgG, avgB, -38, -74, 112);
+        __m256i cr = chromaAVX2(avgR, avgG, avgB, 112, -94, -18);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(u + x / 2), packChromaAVX2(cb));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(v + x / 2), packChromaAVX2(cr));
+    }
+
+    convertRowPairScalarFrom(x, row0, row1, width, layout, y0, y1, u, v);
+}
+#endif
+
+std::vector<ConverterVariant> converterVariants() {
+    std::vector<ConverterVariant> variants;
+    variants.push_back({"scalar", convertRowPairScalar, true});
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    variants.push_back({"sse2", convertRowPairSSE2, __builtin_cpu_supports("sse2") != 0});
+    variants.push_back({"avx2", convertRowPairAVX2, __builtin_cpu_supports("avx2") != 0});
+#endif
+    return variants;
+}
+
+const ConverterVariant& selectConverter() {
+    static const ConverterVariant best = [] {
+        std::vector<ConverterVariant> variants = converterVariants();
+        ConverterVariant chosen = variants.front();
+        for (const ConverterVariant& variant : variants) {
+            if (variant.supported) chosen = variant;
+        }
+        return chosen;
+    }();
+    return best;
+}
+
+template <int Bytes, bool SwapBytes>
+inline uint32_t loadPixel(const uint8_t* p) {
+    uint32_t value = 0;
+    memcpy(&value, p, Bytes);
+    if (SwapBytes) value = __builtin_bswap32(value) >> (32 - 8 * Bytes);
+    return value;
+}
+
+inline int expandBits(int c, int bits) {
+    return bits >= 8 ? c : (c << (8 - bits)) | (c >> (2 * bits - 8));
+}
+
+template <int Shift, int Bits>
+inline int expandChannel(uint32_t pixel) {
+    return expandBits((pixel >> Shift) & ((1 << Bits) - 1), Bits);
+}
+
+template <int Bytes, bool SwapBytes, int RedShift, int RedBits, int GreenShift, int GreenBits,
+          int BlueShift, int BlueBits>
+void convertRowPairPacked(const uint8_t* row0, const uint8_t* row1, int width,
+                          const PixelLayout&, uint8_t* y0, uint8_t* y1,
+                          uint8_t* u, uint8_t* v) {
+    for (int x = 0; x < width; x += 2) {
+        int x1 = (x + 1 < width) ? x + 1 : x;
+        const uint32_t pixels[4] = {
+            loadPixel<Bytes, SwapBytes>(row0 + x * Bytes), loadPixel<Bytes, SwapBytes>(row0 + x1 * Bytes),
+            loadPixel<Bytes, SwapBytes>(row1 + x * Bytes), loadPixel<Bytes, SwapBytes>(row1 + x1 * Bytes)
+        };
+        int sumR = 0, sumG = 0, sumB = 0;
+        uint8_t luma[4];
+
+        for (int i = 0; i < 4; i++) {
+            int r = expandChannel<RedShift, RedBits>(pixels[i]);
+            int g = expandChannel<GreenShift, GreenBits>(pixels[i]);
+            int b = expandChannel<BlueShift, BlueBits>(pixels[i]);
+            luma[i] = rgbToY(r, g, b);
+            sumR += r;
+            sumG += g;
+            sumB += b;
+        }
+
+        y0[x] = luma[0];
+        y1[x] = luma[2];
+        if (x1 != x) {
+            y0[x1] = luma[1];
+            y1[x1] = luma[3];
+        }
+
+        int r = (sumR + 2) >> 2;
+        int g = (sumG + 2) >> 2;
+        int b = (sumB + 2) >> 2;
+        u[x / 2] = rgbToU(r, g, b);
+        v[x / 2] = rgbToV(r, g, b);
+    }
+}
+
+struct PixelKernel {
+    const char* name;
+    PixelLayout layout;
+    AVPixelFormat avFormat;
+    ConvertRowPairFn convert;
+};
+
+const PixelKernel PIXEL_KERNELS[] = {
+    {"bgrx32", {32, 16, 8, 0}, AV_PIX_FMT_BGR0, convertRowPairPacked<4, false, 16, 8, 8, 8, 0, 8>},
+    {"rgbx32", {32, 0, 8, 16}, AV_PIX_FMT_RGB0, convertRowPairPacked<4, false, 0, 8, 8, 8, 16, 8>},
+    {"xrgb32", {32, 8, 16, 24}, AV_PIX_FMT_0RGB, convertRowPairPacked<4, false, 8, 8, 16, 8, 24, 8>},
+    {"xbgr32", {32, 24, 16, 8}, AV_PIX_FMT_0BGR, convertRowPairPacked<4, false, 24, 8, 16, 8, 8, 8>},
+    {"bgr24", {24, 16, 8, 0}, AV_PIX_FMT_BGR24, convertRowPairPacked<3, false, 16, 8, 8, 8, 0, 8>},
+    {"rgb24", {24, 0, 8, 16}, AV_PIX_FMT_RGB24, convertRowPairPacked<3, false, 0, 8, 8, 8, 16, 8>},
+    {"rgb565le", {16, 11, 5, 0, 5, 6, 5, false}, AV_PIX_FMT_RGB565LE,
+     convertRowPairPacked<2, false, 11, 5, 5, 6, 0, 5>},
+    {"rgb565be", {16, 11, 5, 0, 5, 6, 5, true}, AV_PIX_FMT_RGB565BE,
+     convertRowPairPacked<2, true, 11, 5, 5, 6, 0, 5>},
+    {"bgr565le", {16, 0, 5, 11, 5, 6, 5, false}, AV_PIX_FMT_BGR565LE,
+     convertRowPairPacked<2, false, 0, 5, 5, 6, 11, 5>},
+    {"bgr565be", {16, 0, 5, 11, 5, 6, 5, true}, AV_PIX_FMT_BGR565BE,
+     convertRowPairPacked<2, true, 0, 5, 5, 6, 11, 5>},
+    {"rgb555le", {16, 10, 5, 0, 5, 5, 5, false}, AV_PIX_FMT_RGB555LE,
+     convertRowPairPacked<2, false, 10, 5, 5, 5, 0, 5>},
+    {"rgb555be", {16, 10, 5, 0, 5, 5, 5, true}, AV_PIX_FMT_RGB555BE,
+     convertRowPairPacked<2, true, 10, 5, 5, 5, 0, 5>},
+    {"bgr555le", {16, 0, 5, 10, 5, 5, 5, false}, AV_PIX_FMT_BGR555LE,
+     convertRowPairPacked<2, false, 0, 5, 5, 5, 10, 5>},
+    {"bgr555be", {16, 0, 5, 10, 5, 5, 5, true}, AV_PIX_FMT_BGR555BE,
+     convertRowPairPacked<2, true, 0, 5, 5, 5, 10, 5>},
+};
+
+bool sameLayout(const PixelLayout& a, const PixelLayout& b) {
+    return a.bitsPerPixel == b.bitsPerPixel && a.redShift == b.redShift && a.greenShift == b.greenShift &&
+           a.blueShift == b.blueShift && a.redBits == b.redBits && a.greenBits == b.greenBits &&
+           a.blueBits == b.blueBits && a.swapBytes == b.swapBytes;
+}
+
+const PixelKernel* findPixelKernel(const PixelLayout& layout) {
+    for (const PixelKernel& kernel : PIXEL_KERNELS) {
+        if (sameLayout(kernel.layout, layout)) return &kernel;
+    }
+    return nullptr;
+}
+
+ConvertRowPairFn selectPixelConverter(const PixelLayout& layout) {
+    const PixelKernel* kernel = findPixelKernel(layout);
+    if (!kernel) return nullptr;
+    const ConverterVariant& simd = selectConverter();
+    if (layout.bitsPerPixel == 32 && simd.convert != convertRowPairScalar) return simd.convert;
+    return kernel->convert;
+}
+
+bool pixelLayoutFromImage(const XImage* image, PixelLayout& layout) {
+    int bits = image->bits_per_pixel;
+    if ((bits != 16 && bits != 24 && bits != 32) || !image->red_mask || !image->green_mask || !image->blue_mask) {
+        return false;
+    }
+
+    layout.bitsPerPixel = bits;
+    layout.redShift = __builtin_ctzl(image->red_mask);
+    layout.greenShift = __builtin_ctzl(image->green_mask);
+    layout.blueShift = __builtin_ctzl(image->blue_mask);
+    layout.redBits = __builtin_popcountl(image->red_mask);
+    layout.greenBits = __builtin_popcountl(image->green_mask);
+    layout.blueBits = __builtin_popcountl(image->blue_mask);
+    layout.swapBytes = false;
+    if (image->byte_order == MSBFirst) {
+        if (bits == 16) {
+            layout.swapBytes = true;
+        } else {
+            layout.redShift = bits - 8 - layout.redShift;
+            layout.greenShift = bits - 8 - layout.greenShift;
+            layout.blueShift = bits - 8 - layout.blueShift;
+        }
+    }
+    return findPixelKernel(layout) != nullptr;
+}
+
+void convertRectToYUV420P(ConvertRowPairFn convert, const uint8_t* src, int srcStride,
+                          int height, const PixelLayout& layout, AVFrame* frame,
+                          int left, int top, int right, int bottom) {
+    int bytesPerPixel = layout.bitsPerPixel / 8;
+    for (int row = top; row < bottom; row += 2) {
+        int nextRow = (row + 1 < height) ? row + 1 : row;
+        convert(src + row * srcStride + left * bytesPerPixel,
+                src + nextRow * srcStride + left * bytesPerPixel,
+                right - left, layout,
+                frame->data[0] + row * frame->linesize[0] + left,
+                frame->data[0] + nextRow * frame->linesize[0] + left,
+                frame->data[1] + (row / 2) * frame->linesize[1] + left / 2,
+                frame->data[2] + (row / 2) * frame->linesize[2] + left / 2);
+    }
+}
+
+void convertToYUV420P(ConvertRowPairFn convert, const uint8_t* src, int srcStride,
+                      int width, int height, const PixelLayout& layout, AVFrame* frame) {
+    convertRectToYUV420P(convert, src, srcStride, height, layout, frame, 0, 0, width, height);
+}
+
+void resetTileDamage(TileDamage& damage, int width, int height) {
+    damage.tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    damage.tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    damage.hashes.assign(damage.tilesX * damage.tilesY, 0);
+    damage.scratch.assign(damage.tilesX * damage.tilesY, 0);
+    damage.dirty.assign(damage.tilesX * damage.tilesY, 1);
+    damage.dirtyCount = damage.tilesX * damage.tilesY;
+    damage.primed = false;
+}
+
+inline uint64_t mixHash(uint64_t hash, uint64_t value) {
+    hash ^= value * 0x9e3779b97f4a7c15ULL;
+    return ((hash << 31) | (hash >> 33)) * 0xbf58476d1ce4e5b9ULL;
+}
+
+inline uint64_t hashBytes(uint64_t hash, const uint8_t* data, int size) {
+    int offset = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    alignas(16) static const uint64_t keys[16] = {
+        0x1cad21f72c81017cULL, 0xbe99a0ad9c36b8d8ULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+        0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+        0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+        0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL,
+    };
+    __m128i acc = _mm_set_epi64x(static_cast<long long>(hash), static_cast<long long>(~hash));
+    for (int block = 0; offset + 16 <= size; offset += 16, block = (block + 2) & 15) {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+        __m128i keyed = _mm_xor_si128(value, _mm_load_si128(reinterpret_cast<const __m128i*>(keys + block)));
+        __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+        acc = _mm_add_epi64(acc, _mm_add_epi64(product, _mm_shuffle_epi32(value, 0x4e)));
+    }
+    alignas(16) uint64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    hash = mixHash(lanes[0], lanes[1]);
+#endif
+    for (; offset + 8 <= size; offset += 8) {
+        uint64_t value;
+        memcpy(&value, data + offset, 8);
+        hash = mixHash(hash, value);
+    }
+    if (offset < size) {
+        uint64_t value = 0;
+        memcpy(&value, data + offset, size - offset);
+        hash = mixHash(hash, value);
+    }
+    return hash;
+}
+
+int updateTileDamage(TileDamage& damage, const uint8_t* data, int stride,
+                     int width, int height, int bytesPerPixel) {
+    std::fill(damage.scratch.begin(), damage.scratch.end(), 0);
+    int tileBytes = TILE_SIZE * bytesPerPixel;
+    int rowBytes = width * bytesPerPixel;
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = data + y * stride;
+        uint64_t* tileHashes = damage.scratch.data() + (y / TILE_SIZE) * damage.tilesX;
+
+        for (int tx = 0; tx < damage.tilesX; tx++) {
+            int begin = tx * tileBytes;
+            int end = std::min(begin + tileBytes, rowBytes);
+            tileHashes[tx] = hashBytes(tileHashes[tx], row + begin, end - begin);
+        }
+    }
+
+    damage.dirtyCount = 0;
+    for (size_t i = 0; i < damage.hashes.size(); i++) {
+        bool changed = !damage.primed || damage.scratch[i] != damage.hashes[i];
+        damage.dirty[i] = changed;
+        damage.dirtyCount += changed;
+    }
+    damage.hashes.swap(damage.scratch);
+    damage.primed = true;
+    return damage.dirtyCount;
+}
+
+void convertDirtyTiles(ConvertRowPairFn convert, const uint8_t* src, int srcStride,
+                       int width, int height, const PixelLayout& layout,
+                       const TileDamage& damage, AVFrame* frame) {
+    for (int ty = 0; ty < damage.tilesY; ty++) {
+        const uint8_t* dirty = damage.dirty.data() + ty * damage.tilesX;
+        int top = ty * TILE_SIZE;
+        int bottom = std::min(top + TILE_SIZE, height);
+
+        for (int tx = 0; tx < damage.tilesX; tx++) {
+            if (!dirty[tx]) continue;
+            int runStart = tx;
+            while (tx + 1 < damage.tilesX && dirty[tx + 1]) tx++;
+            convertRectToYUV420P(convert, src, srcStride, height, layout, frame,
+                                 runStart * TILE_SIZE, top,
+                                 std::min((tx + 1) * TILE_SIZE, width), bottom);
+        }
+    }
+}
+
+void copyTiles(const AVFrame* src, AVFrame* dst, const std::vector<uint8_t>& tiles,
+               int tilesX, int tilesY, int width, int height) {
+    for (int ty = 0; ty < tilesY; ty++) {
+        const uint8_t* marked = tiles.data() + ty * tilesX;
+        int top = ty * TILE_SIZE;
+        int bottom = std::min(top + TILE_SIZE, height);
+
+        for (int tx = 0; tx < tilesX; tx++) {
+            if (!marked[tx]) continue;
+            int runStart = tx;
+            while (tx + 1 < tilesX && marked[tx + 1]) tx++;
+            int left = runStart * TILE_SIZE;
+            int right = std::min((tx + 1) * TILE_SIZE, width);
+            for (int y = top; y < bottom; y++) {
+                memcpy(dst->data[0] + y * dst->linesize[0] + left,
+                       src->data[0] + y * src->linesize[0] + left, right - left);
+            }
+            for (int plane = 1; plane < 3; plane++) {
+                for (int y = top / 2; y < (bottom + 1) / 2; y++) {
+                    memcpy(dst->data[plane] + y * dst->linesize[plane] + left / 2,
+                           src->data[plane] + y * src->linesize[plane] + left / 2,
+                           (right + 1) / 2 - left / 2);
+                }
+            }
+        }
+    }
+}
+
+void markDamageRect(TileDamage& damage, int left, int top, int right, int bottom) {
+    if (right <= 0 || bottom <= 0 || damage.tilesX == 0) return;
+    int firstX = std::max(0, left) / TILE_SIZE;
+    int firstY = std::max(0, top) / TILE_SIZE;
+    int lastX = std::min(damage.tilesX - 1, (right - 1) / TILE_SIZE);
+    int lastY = std::min(damage.tilesY - 1, (bottom - 1) / TILE_SIZE);
+    for (int ty = firstY; ty <= lastY; ty++) {
+        for (int tx = firstX; tx <= lastX; tx++) {
+            uint8_t& dirty = damage.dirty[ty * damage.tilesX + tx];
+            damage.dirtyCount += !dirty;
+            dirty = 1;
+        }
+    }
+}
+
+void cursorCanvas(const CursorImage& cursor, int& left, int& top, int& width, int& height) {
+    int parityX = cursor.x & 1;
+    int parityY = cursor.y & 1;
+    left = cursor.x - parityX;
+    top = cursor.y - parityY;
+    width = (cursor.width + parityX + 1) & ~1;
+    height = (cursor.height + parityY + 1) & ~1;
+}
+
+bool cursorChanged(const CursorPlanes& planes, const CursorImage* cursor) {
+    if (!cursor) return planes.drawn;
+    return !planes.drawn || planes.serial != cursor->serial ||
+           planes.drawnX != cursor->x || planes.drawnY != cursor->y;
+}
+
+void markCursorDamage(TileDamage& damage, const CursorPlanes& planes, const CursorImage* cursor) {
+    if (planes.drawn) {
+        int left = planes.drawnX - planes.parityX;
+        int top = planes.drawnY - planes.parityY;
+        markDamageRect(damage, left, top, left + planes.width, top + planes.height);
+    }
+    if (cursor) {
+        int left, top, width, height;
+        cursorCanvas(*cursor, left, top, width, height);
+        markDamageRect(damage, left, top, left + width, top + height);
+    }
+}
+
+void buildCursorPlanes(CursorPlanes& planes, const CursorImage& cursor) {
+    int left, top;
+    cursorCanvas(cursor, left, top, planes.width, planes.height);
+    planes.serial = cursor.serial;
+    planes.parityX = cursor.x & 1;
+    planes.parityY = cursor.y & 1;
+
+    int width = planes.width;
+    int height = planes.height;
+    planes.luma.assign(width * height, 0);
+    planes.lumaAlpha.assign(width * height, 0);
+    planes.cb.assign(width * height / 4, 0);
+    planes.cr.assign(width * height / 4, 0);
+    planes.chromaAlpha.assign(width * height / 4, 0);
+
+    for (int y = 0; y < height; y += 2) {
+        for (int x = 0; x < width; x += 2) {
+            int sumA = 0, sumR = 0, sumG = 0, sumB = 0;
+            for (int i = 0; i < 4; i++) {
+                int cx = x + (i & 1);
+                int cy = y + (i >> 1);
+                int sx = cx - planes.parityX;
+                int sy = cy - planes.parityY;
+                uint32_t pixel = 0;
+                if (sx >= 0 && sy >= 0 && sx < cursor.width && sy < cursor.height) {
+                    pixel = cursor.pixels[sy * cursor.width + sx];
+                }
+                int a = pixel >> 24;
+                int r = (pixel >> 16) & 0xff;
+                int g = (pixel >> 8) & 0xff;
+                int b = pixel & 0xff;
+                planes.luma[cy * width + cx] =
+                    static_cast<int16_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + (16 * a + 127) / 255);
+                planes.lumaAlpha[cy * width + cx] = static_cast<uint8_t>(a);
+                sumA += a;
+                sumR += r;
+                sumG += g;
+                sumB += b;
+            }
+
+            int a = (sumA + 2) >> 2;
+            int r = (sumR + 2) >> 2;
+            int g = (sumG + 2) >> 2;
+            int b = (sumB + 2) >> 2;
+            int chroma = (y / 2) * (width / 2) + x / 2;
+            planes.cb[chroma] = static_cast<int16_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + (128 * a + 127) / 255);
+            planes.cr[chroma] = static_cast<int16_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + (128 * a + 127) / 255);
+            planes.chromaAlpha[chroma] = static_cast<uint8_t>(a);
+        }
+    }
+}
+
+void blendCursorRowScalarFrom(int start, uint8_t* dst, const int16_t* src, const uint8_t* alpha, int count) {
+    for (int i = start; i < count; i++) {
+        int t = dst[i] * (255 - alpha[i]) + 128;
+        int value = ((t + (t >> 8)) >> 8) + src[i];
+        dst[i] = static_cast<uint8_t>(std::max(0, std::min(255, value)));
+    }
+}
+
+void blendCursorRow(uint8_t* dst, const int16_t* src, const uint8_t* alpha, int count) {
+    int i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(128);
+    for (; i + 8 <= count; i += 8) {
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(dst + i)), zero);
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(alpha + i)), zero);
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(opaque, a)), round);
+        __m128i scaled = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+        __m128i value = _mm_add_epi16(scaled, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(value, value));
+    }
+#endif
+    blendCursorRowScalarFrom(i, dst, src, alpha, count);
+}
+
+void blendCursor(CursorPlanes& planes, const CursorImage* cursor, AVFrame* frame, int width, int height) {
+    planes.drawn = false;
+    if (!cursor) return;
+    if (planes.width == 0 || planes.serial != cursor->serial ||
+        planes.parityX != (cursor->x & 1) || planes.parityY != (cursor->y & 1)) {
+        buildCursorPlanes(planes, *cursor);
+    }
+
+    int left = cursor->x - planes.parityX;
+    int top = cursor->y - planes.parityY;
+    int x0 = std::max(0, left);
+    int y0 = std::max(0, top);
+    int x1 = std::min(width, left + planes.width);
+    int y1 = std::min(height, top + planes.height);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    for (int y = y0; y < y1; y++) {
+        int offset = (y - top) * planes.width + (x0 - left);
+        blendCursorRow(frame->data[0] + y * frame->linesize[0] + x0,
+                       planes.luma.data() + offset, planes.lumaAlpha.data() + offset, x1 - x0);
+    }
+    for (int y = y0 / 2; y < y1 / 2; y++) {
+        int offset = (y - top / 2) * (planes.width / 2) + (x0 - left) / 2;
+        blendCursorRow(frame->data[1] + y * frame->linesize[1] + x0 / 2,
+                       planes.cb.data() + offset, planes.chromaAlpha.data() + offset, (x1 - x0) / 2);
+        blendCursorRow(frame->data[2] + y * frame->linesize[2] + x0 / 2,
+                       planes.cr.data() + offset, planes.chromaAlpha.data() + offset, (x1 - x0) / 2);
+    }
+    planes.drawn = true;
+    planes.drawnX = cursor->x;
+    planes.drawnY = cursor->y;
+}
+
+
+double planePSNR(const uint8_t* a, int strideA, const uint8_t* b, int strideB,
+                 int width, int height, int& maxError) {
+    double squaredError = 0.0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int diff = std::abs(a[y * strideA + x] - b[y * strideB + x]);
+            maxError = std::max(maxError, diff);
+            squaredError += diff * diff;
+        }
+    }
+    double mse = squaredError / (static_cast<double>(width) * height);
+    return mse == 0.0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+bool framesEqual(const AVFrame* a, const AVFrame* b, int width, int height) {
+    for (int plane = 0; plane < 3; plane++) {
+        int planeWidth = plane ? (width + 1) / 2 : width;
+        int planeHeight = plane ? (height + 1) / 2 : height;
+        for (int y = 0; y < planeHeight; y++) {
+            if (memcmp(a->data[plane] + y * a->linesize[plane],
+                       b->data[plane] + y * b->linesize[plane], planeWidth) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+AVFrame* allocYUVFrame(int width, int height) {
+    AVFrame* frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0) {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    return frame;
+}
+
+AVBufferRef* allocPoolBuffer(void*, size_t size) {
+    telemetry.poolAllocations.fetch_add(1, std::memory_order_relaxed);
+    return av_buffer_alloc(size);
+}
+
+AVBufferPool* createFramePool(int width, int height) {
+    int size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 32);
+    if (size < 0) return nullptr;
+    return av_buffer_pool_init2(size, nullptr, allocPoolBuffer, nullptr);
+}
+
+AVFrame* acquirePoolFrame(AVBufferPool* pool, int width, int height) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) return nullptr;
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    frame->buf[0] = av_buffer_pool_get(pool);
+    if (!frame->buf[0] ||
+        av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                             AV_PIX_FMT_YUV420P, width, height, 32) < 0) {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    return frame;
+}
+
+void releaseFrameSlots(RecordingContext& ctx) {
+    for (FrameSlot& slot : ctx.frameSlots) av_frame_free(&slot.frame);
+    ctx.frameSlots.clear();
+    ctx.lastSlot = -1;
+}
+
+// Frames are recycled in place: a slot is reused once no queue entry, preview or encoder
+// reference is left on it, so the steady state allocates neither frames nor buffer refs.
+int acquireFrameSlot(RecordingContext& ctx) {
+    std::lock_guard<std::mutex> lock(ctx.queueMutex);
+    for (int i = 0; i < static_cast<int>(ctx.frameSlots.size()); i++) {
+        if (ctx.frameSlots[i].users == 0 && av_frame_is_writable(ctx.frameSlots[i].frame)) return i;
+    }
+
+    CountAllocations growth(false);
+    AVFrame* frame = acquirePoolFrame(ctx.framePool, ctx.videoParameters->width, ctx.videoParameters->height);
+    if (!frame) return -1;
+    ctx.frameSlots.push_back({frame, 0, std::vector<uint8_t>(ctx.damage.dirty.size(), 1)});
+    return static_cast<int>(ctx.frameSlots.size()) - 1;
+}
+
+void refreshFrameSlot(RecordingContext& ctx, int target, int width, int height) {
+    FrameSlot& slot = ctx.frameSlots[target];
+    if (ctx.lastSlot >= 0) {
+        uint64_t copied = 0;
+        for (size_t tile = 0; tile < slot.stale.size(); tile++) {
+            slot.stale[tile] = slot.stale[tile] && !ctx.damage.dirty[tile];
+            copied += slot.stale[tile];
+        }
+        copyTiles(ctx.frameSlots[ctx.lastSlot].frame, slot.frame, slot.stale,
+                  ctx.damage.tilesX, ctx.damage.tilesY, width, height);
+        telemetry.copiedTiles.fetch_add(copied, std::memory_order_relaxed);
+    }
+    std::fill(slot.stale.begin(), slot.stale.end(), 0);
+    for (int i = 0; i < static_cast<int>(ctx.frameSlots.size()); i++) {
+        if (i == target) continue;
+        std::vector<uint8_t>& stale = ctx.frameSlots[i].stale;
+        for (size_t tile = 0; tile < stale.size(); tile++) stale[tile] |= ctx.damage.dirty[tile];
+    }
+}
+
+void holdLastSlot(RecordingContext& ctx, int slot) {
+    std::lock_guard<std::mutex> lock(ctx.queueMutex);
+    if (ctx.lastSlot >= 0) ctx.frameSlots[ctx.lastSlot].users--;
+    ctx.frameSlots[slot].users++;
+    ctx.lastSlot = slot;
+}
+
+struct SyntheticVisual {
+    int bitsPerPixel;
+    int byteOrder;
+    unsigned long redMask;
+    unsigned long greenMask;
+    unsigned long blueMask;
+};
+
+const SyntheticVisual SYNTHETIC_VISUALS[] = {
+    {32, LSBFirst, 0xff0000, 0xff00, 0xff}, {32, LSBFirst, 0xff, 0xff00, 0xff0000},
+    {32, MSBFirst, 0xff0000, 0xff00, 0xff}, {32, MSBFirst, 0xff, 0xff00, 0xff0000},
+    {24, LSBFirst, 0xff0000, 0xff00, 0xff}, {24, LSBFirst, 0xff, 0xff00, 0xff0000},
+    {24, MSBFirst, 0xff0000, 0xff00, 0xff}, {24, MSBFirst, 0xff, 0xff00, 0xff0000},
+    {16, LSBFirst, 0xf800, 0x07e0, 0x001f}, {16, MSBFirst, 0xf800, 0x07e0, 0x001f},
+    {16, LSBFirst, 0x001f, 0x07e0, 0xf800}, {16, MSBFirst, 0x001f, 0x07e0, 0xf800},
+    {16, LSBFirst, 0x7c00, 0x03e0, 0x001f}, {16, MSBFirst, 0x7c00, 0x03e0, 0x001f},
+    {16, LSBFirst, 0x001f, 0x03e0, 0x7c00}, {16, MSBFirst, 0x001f, 0x03e0, 0x7c00},
+};
+
+int quantizeChannel(uint32_t rgb, int channelShift, unsigned long mask, int& value) {
+    int bits = __builtin_popcountl(mask);
+    int c = ((rgb >> channelShift) & 0xff) >> (8 - bits);
+    value |= c << __builtin_ctzl(mask);
+    return expandBits(c, bits);
+}
+
+void convertRowPairMaskShift(const uint8_t* row0, const uint8_t* row1, int width,
+                             const PixelLayout& layout, uint8_t* y0, uint8_t* y1,
+                             uint8_t* u, uint8_t* v) {
+    int bytes = layout.bitsPerPixel / 8;
+    for (int x = 0; x < width; x += 2) {
+        int x1 = (x + 1 < width) ? x + 1 : x;
+        const uint8_t* sources[4] = { row0 + x * bytes, row0 + x1 * bytes, row1 + x * bytes, row1 + x1 * bytes };
+        int sumR = 0, sumG = 0, sumB = 0;
+        uint8_t luma[4];
+
+        for (int i = 0; i < 4; i++) {
+            uint32_t pixel = 0;
+            memcpy(&pixel, sources[i], bytes);
+            if (layout.swapBytes) pixel = __builtin_bswap32(pixel) >> (32 - 8 * bytes);
+            int r = expandBits((pixel >> layout.redShift) & ((1u << layout.redBits) - 1), layout.redBits);
+            int g = expandBits((pixel >> layout.greenShift) & ((1u << layout.greenBits) - 1), layout.greenBits);
+            int b = expandBits((pixel >> layout.blueShift) & ((1u << layout.blueBits) - 1), layout.blueBits);
+            luma[i] = rgbToY(r, g, b);
+            sumR += r;
+            sumG += g;
+            sumB += b;
+        }
+
+        y0[x] = luma[0];
+        y1[x] = luma[2];
+        if (x1 != x) {
+            y0[x1] = luma[1];
+            y1[x1] = luma[3];
+        }
+
+        int r = (sumR + 2) >> 2;
+        int g = (sumG + 2) >> 2;
+        int b = (sumB + 2) >> 2;
+        u[x / 2] = rgbToU(r, g, b);
+        v[x / 2] = rgbToV(r, g, b);
+    }
+}
+
+double timePixelConverter(ConvertRowPairFn convert, const uint8_t* src, int stride, int width, int height,
+                          const PixelLayout& layout, AVFrame* output, const AVFrame* reference, bool& identical) {
+    const int iterations = 10;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        convertToYUV420P(convert, src, stride, width, height, layout, output);
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count() / iterations / (width * height);
+    identical = identical && framesEqual(output, reference, width, height);
+    return ns;
+}
+
+bool runPixelKernelChecks(const std::vector<uint32_t>& source, int width, int height) {
+    const int pixels = width * height;
+    std::vector<uint8_t> packed(pixels * 4);
+    std::vector<uint32_t> expanded(pixels);
+    AVFrame* reference = allocYUVFrame(width, height);
+    AVFrame* output = allocYUVFrame(width, height);
+    if (!reference || !output) {
+        std::cerr << "Could not set up pixel kernel checks\n";
+        av_frame_free(&reference);
+        av_frame_free(&output);
+        return false;
+    }
+
+    bool ok = true;
+    for (const SyntheticVisual& visual : SYNTHETIC_VISUALS) {
+        int bytes = visual.bitsPerPixel / 8;
+        for (int i = 0; i < pixels; i++) {
+            int value = 0;
+            int r = quantizeChannel(source[i], 16, visual.redMask, value);
+            int g = quantizeChannel(source[i], 8, visual.greenMask, value);
+            int b = quantizeChannel(source[i], 0, visual.blueMask, value);
+            expanded[i] = 0xff000000u | (r << 16) | (g << 8) | b;
+            for (int byte = 0; byte < bytes; byte++) {
+                int shift = visual.byteOrder == MSBFirst ? 8 * (bytes - 1 - byte) : 8 * byte;
+                packed[i * bytes + byte] = static_cast<uint8_t>(static_cast<uint32_t>(value) >> shift);
+            }
+        }
+
+        XImage image = {};
+        image.width = width;
+        image.height = height;
+        image.format = ZPixmap;
+        image.data = reinterpret_cast<char*>(packed.data());
+        image.byte_order = visual.byteOrder;
+        image.bits_per_pixel = visual.bitsPerPixel;
+        image.bytes_per_line = width * bytes;
+        image.red_mask = visual.redMask;
+        image.green_mask = visual.greenMask;
+        image.blue_mask = visual.blueMask;
+
+        char description[64];
+        snprintf(description, sizeof(description), "%dbpp %s %06lx/%06lx/%06lx", visual.bitsPerPixel,
+                 visual.byteOrder == MSBFirst ? "MSB" : "LSB", visual.redMask, visual.greenMask, visual.blueMask);
+        PixelLayout layout{};
+        if (!pixelLayoutFromImage(&image, layout)) {
+            printf("%-34s no kernel  FAIL\n", description);
+            ok = false;
+            continue;
+        }
+
+        convertToYUV420P(convertRowPairScalar, reinterpret_cast<const uint8_t*>(expanded.data()), width * 4,
+                         width, height, {32, 16, 8, 0}, reference);
+
+        const PixelKernel* kernel = findPixelKernel(layout);
+        const uint8_t* src = packed.data();
+        int stride = image.bytes_per_line;
+        bool identical = true;
+        double templateNs = timePixelConverter(kernel->convert, src, stride, width, height, layout,
+                                               output, reference, identical);
+        ConvertRowPairFn selected = selectPixelConverter(layout);
+        double selectedNs = selected == kernel->convert
+            ? templateNs
+            : timePixelConverter(selected, src, stride, width, height, layout, output, reference, identical);
+        double maskShiftNs = timePixelConverter(convertRowPairMaskShift, src, stride, width, height, layout,
+                                                output, reference, identical);
+        ok = ok && identical;
+
+        printf("%-34s %-9s template %6.3f  dispatched %6.3f  mask/shift %6.3f ns/pixel  %s\n", description,
+               kernel->name, templateNs, selectedNs, maskShiftNs, identical ? "ok" : "FAIL");
+    }
+
+    av_frame_free(&reference);
+    av_frame_free(&output);
+    return ok;
+}
+
+int scalerThreads() {
+    return std::max(1, std::min(8, static_cast<int>(std::thread::hardware_concurrency())));
+}
+
+SwsContext* createFrameScaler(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int flags, int threads) {
+    SwsContext* sws = sws_alloc_context();
+    if (!sws) return nullptr;
+    av_opt_set_int(sws, "srcw", srcWidth, 0);
+    av_opt_set_int(sws, "srch", srcHeight, 0);
+    av_opt_set_int(sws, "src_format", AV_PIX_FMT_YUV420P, 0);
+    av_opt_set_int(sws, "dstw", dstWidth, 0);
+    av_opt_set_int(sws, "dsth", dstHeight, 0);
+    av_opt_set_int(sws, "dst_format", AV_PIX_FMT_YUV420P, 0);
+    av_opt_set_int(sws, "sws_flags", flags, 0);
+    av_opt_set_int(sws, "threads", threads, 0);
+    if (sws_init_context(sws, nullptr, nullptr) < 0) {
+        sws_freeContext(sws);
+        return nullptr;
+    }
+    return sws;
+}
+
+int runScaleBenchmark() {
+    struct ScaleCase {
+        int srcWidth, srcHeight, dstWidth, dstHeight;
+    };
+    const ScaleCase cases[] = {{1920, 1080, 1280, 720}, {2560, 1440, 1920, 1080}, {3840, 2160, 1920, 1080}};
+    const struct {
+        const char* name;
+        int flags;
+    } qualities[] = {{"fast", SWS_FAST_BILINEAR}, {"balanced", SWS_BILINEAR}, {"best", SWS_LANCZOS}};
+    const int iterations = 30;
+    const int threads = scalerThreads();
+
+    bool ok = true;
+    for (const ScaleCase& scale : cases) {
+        AVFrame* src = allocYUVFrame(scale.srcWidth, scale.srcHeight);
+        AVFrame* dst = allocYUVFrame(scale.dstWidth, scale.dstHeight);
+        if (!src || !dst) {
+            std::cerr << "Could not set up scale benchmark\n";
+            av_frame_free(&src);
+            av_frame_free(&dst);
+            return 1;
+        }
+        for (int y = 0; y < scale.srcHeight; y++) {
+            for (int x = 0; x < scale.srcWidth; x++) {
+                src->data[0][y * src->linesize[0] + x] = static_cast<uint8_t>((x ^ y) + x / 7);
+            }
+        }
+        for (int plane = 1; plane < 3; plane++) {
+            for (int y = 0; y < scale.srcHeight / 2; y++) {
+                memset(src->data[plane] + y * src->linesize[plane], 64 * plane + y % 64, scale.srcWidth / 2);
+            }
+        }
+
+        for (const auto& quality : qualities) {
+            for (int count : {1, threads}) {
+                SwsContext* sws = createFrameScaler(scale.srcWidth, scale.srcHeight, scale.dstWidth, scale.dstHeight,
+                                                   quality.flags, count);
+                if (!sws || sws_scale_frame(sws, dst, src) < 0) {
+                    printf("%dx%d -> %dx%d %-8s %d thread(s)  FAIL\n", scale.srcWidth, scale.srcHeight,
+                           scale.dstWidth, scale.dstHeight, quality.name, count);
+                    sws_freeContext(sws);
+                    ok = false;
+                    continue;
+                }
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < iterations; i++) sws_scale_frame(sws, dst, src);
+                double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count() / iterations;
+                printf("%dx%d -> %dx%d %-8s %d thread(s) %7.2f ms/frame\n", scale.srcWidth, scale.srcHeight,
+                       scale.dstWidth, scale.dstHeight, quality.name, count, ms);
+                sws_freeContext(sws);
+                if (threads == 1) break;
+            }
+        }
+        av_frame_free(&src);
+        av_frame_free(&dst);
+    }
+    return ok ? 0 : 1;
+}
+
+int runConvertBenchmark() {
+    const int width = 1920;
+    const int height = 1080;
+    const int iterations = 50;
+    const PixelLayout layout = {32, 16, 8, 0};
+
+    std::vector<uint32_t> image(width * height);
+    uint32_t seed = 12345;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1664525u + 1013904223u;
+            uint32_t noise = (seed >> 24) & 0x0f;
+            uint32_t r = (x * 255 / width) ^ noise;
+            uint32_t g = (y * 255 / height) ^ noise;
+            uint32_t b = ((x + y) & 0xff) ^ noise;
+            image[y * width + x] = 0xff000000u | (r << 16) | (g << 8) | b;
+        }
+    }
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(image.data());
+    int srcStride = width * 4;
+
+    AVFrame* reference = allocYUVFrame(width, height);
+    AVFrame* output = allocYUVFrame(width, height);
+    SwsContext* sws = sws_getContext(width, height, AV_PIX_FMT_BGRA, width, height,
+                                     AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!reference || !output || !sws) {
+        std::cerr << "Could not set up conversion benchmark\n";
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        sws_scale(sws, &src, &srcStride, 0, height, reference->data, reference->linesize);
+    }
+    double swsNs = std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - start).count() / iterations / (width * height);
+    printf("%-8s %6.3f ns/pixel\n", "swscale", swsNs);
+
+    bool ok = true;
+    for (const ConverterVariant& variant : converterVariants()) {
+        if (!variant.supported) {
+            printf("%-8s not supported on this CPU\n", variant.name);
+            continue;
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            convertToYUV420P(variant.convert, src, srcStride, width, height, layout, output);
+        }
+        double ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count() / iterations / (width * height);
+
+        int maxError = 0;
+        double psnrY = planePSNR(output->data[0], output->linesize[0], reference->data[0],
+                                 reference->linesize[0], width, height, maxError);
+        double psnrU = planePSNR(output->data[1], output->linesize[1], reference->data[1],
+                                 reference->linesize[1], width / 2, height / 2, maxError);
+        double psnrV = planePSNR(output->data[2], output->linesize[2], reference->data[2],
+                                 reference->linesize[2], width / 2, height / 2, maxError);
+        bool passed = psnrY >= 40.0 && psnrU >= 40.0 && psnrV >= 40.0 && maxError <= 8;
+        ok = ok && passed;
+
+        printf("%-8s %6.3f ns/pixel  PSNR Y %.2f U %.2f V %.2f dB  max error %d  %s\n",
+               variant.name, ns, psnrY, psnrU, psnrV, maxError, passed ? "ok" : "FAIL");
+    }
+
+    AVFrame* incremental = allocYUVFrame(width, height);
+    TileDamage damage{};
+    resetTileDamage(damage, width, height);
+    ConvertRowPairFn convert = selectConverter().convert;
+    updateTileDamage(damage, src, srcStride, width, height, 4);
+    convertDirtyTiles(convert, src, srcStride, width, height, layout, damage, incremental);
+
+    double incrementalNs = 0.0;
+    int64_t dirtyTiles = 0;
+    bool identical = true;
+    for (int i = 0; i < iterations; i++) {
+        for (int change = 0; change < 4; change++) {
+            seed = seed * 1664525u + 1013904223u;
+            int left = (seed >> 8) % (width - 120);
+            int top = (seed >> 20) % (height - 40);
+            for (int y = top; y < top + 40; y++) {
+                for (int x = left; x < left + 120; x++) {
+                    image[y * width + x] ^= seed & 0x00ffffffu;
+                }
+            }
+        }
+
+        start = std::chrono::steady_clock::now();
+        dirtyTiles += updateTileDamage(damage, src, srcStride, width, height, 4);
+        convertDirtyTiles(convert, src, srcStride, width, height, layout, damage, incremental);
+        incrementalNs += std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+
+        convertToYUV420P(convert, src, srcStride, width, height, layout, output);
+        identical = identical && framesEqual(output, incremental, width, height);
+    }
+    ok = ok && identical;
+
+    printf("%-8s %6.3f ns/pixel  %.1f%% tiles dirty  bit-identical to full conversion: %s\n",
+           "dirty", incrementalNs / iterations / (width * height),
+           100.0 * dirtyTiles / iterations / (damage.tilesX * damage.tilesY),
+           identical ? "yes" : "NO");
+
+    ok = runPixelKernelChecks(image, width, height) && ok;
+
+    sws_freeContext(sws);
+    av_frame_free(&reference);
+    av_frame_free(&output);
+    av_frame_free(&incremental);
+    return ok ? 0 : 1;
+}
+
+void joinWarmEncoder(RecordingContext& ctx) {
+    if (ctx.warmThread.joinable()) ctx.warmThread.join();
+}
+
+AVCodecContext* takeWarmEncoder(RecordingContext& ctx, const AVCodec* codec, int width, int height) {
+    joinWarmEncoder(ctx);
+    AVCodecContext* encoder = ctx.warmEncoder;
+    ctx.warmEncoder = nullptr;
+    if (encoder && encoder->codec == codec && encoder->width == width && encoder->height == height) {
+        return encoder;
+    }
+    if (encoder) avcodec_free_context(&encoder);
+    return nullptr;
+}
+
+bool prewarmEncoder(RecordingContext& ctx, int width, int height) {
+    const AVCodec* videoCodec = avcodec_find_encoder(ctx.lossless ? AV_CODEC_ID_FFV1 : AV_CODEC_ID_H264);
+    if (!videoCodec) return false;
+
+    int outputWidth = ctx.scaleWidth > 0 ? ctx.scaleWidth : width & ~1;
+    int outputHeight = ctx.scaleHeight > 0 ? ctx.scaleHeight : height & ~1;
+    ctx.presetIndex = presetLadderIndex(ctx.profile->preset);
+    if (ctx.warmEncoder) avcodec_free_context(&ctx.warmEncoder);
+    ctx.warmEncoder = openVideoEncoder(ctx, videoCodec, outputWidth, outputHeight);
+    return ctx.warmEncoder != nullptr;
+}
+
+void prewarmInBackground(RecordingContext& ctx, int width, int height) {
+    joinWarmEncoder(ctx);
+    ctx.warmThread = std::thread([&ctx, width, height] {
+        if (!prewarmEncoder(ctx, width, height)) std::cerr << "Could not prepare encoder\n";
+    });
+}
+
+void releaseWarmEncoder(RecordingContext& ctx) {
+    joinWarmEncoder(ctx);
+    if (ctx.warmEncoder) avcodec_free_context(&ctx.warmEncoder);
+}
+
+void releaseRecordingResources(RecordingContext& ctx, bool keepEncoder) {
+    ctx.frameQueue.clear();
+    if (ctx.swsContext) sws_freeContext(ctx.swsContext);
+    if (ctx.convertedFrame) av_frame_free(&ctx.convertedFrame);
+    if (ctx.resizedFrame) av_frame_free(&ctx.resizedFrame);
+    if (ctx.resizeContext) {
+        sws_freeContext(ctx.resizeContext);
+        ctx.resizeContext = nullptr;
+    }
+    releaseFrameSlots(ctx);
+    av_buffer_pool_uninit(&ctx.framePool);
+    if (keepEncoder && ctx.videoCodecContext) {
+        releaseWarmEncoder(ctx);
+        ctx.warmEncoder = ctx.videoCodecContext;
+        ctx.videoCodecContext = nullptr;
+    }
+    if (ctx.videoCodecContext) avcodec_free_context(&ctx.videoCodecContext);
+    if (ctx.formatContext) avformat_free_context(ctx.formatContext);
+    if (ctx.videoParameters) avcodec_parameters_free(&ctx.videoParameters);
+    clearReplayBuffer(ctx.replay);
+    for (AVPacket* packet : ctx.pendingAudio) av_packet_free(&packet);
+    ctx.pendingAudio.clear();
+    closeAudioPipeline(ctx.audio);
+    ctx.swsContext = nullptr;
+    ctx.formatContext = nullptr;
+    ctx.videoStream = nullptr;
+    ctx.audioStream = nullptr;
+}
+
+bool abortRecordingInit(RecordingContext& ctx) {
+    releaseRecordingResources(ctx, true);
+    return false;
+}
+
+bool initRecording(RecordingContext& ctx, int width, int height) {
+    const AVCodec* videoCodec = avcodec_find_encoder(ctx.lossless ? AV_CODEC_ID_FFV1 : AV_CODEC_ID_H264);
+    if (!videoCodec) {
+        std::cerr << (ctx.lossless ? "FFV1" : "H.264") << " codec not found\n";
+        return false;
+    }
+
+    width &= ~1;
+    height &= ~1;
+    int outputWidth = ctx.scaleWidth > 0 ? ctx.scaleWidth : width;
+    int outputHeight = ctx.scaleHeight > 0 ? ctx.scaleHeight : height;
+
+    // The warm encoder is joined, or a fresh one opened, before taking the session lock so the
+    // capture thread and preview keep running while libx264 starts up.
+    ctx.presetIndex = presetLadderIndex(ctx.profile->preset);
+    AVCodecContext* encoder = takeWarmEncoder(ctx, videoCodec, outputWidth, outputHeight);
+    if (!encoder) encoder = openVideoEncoder(ctx, videoCodec, outputWidth, outputHeight);
+    if (!encoder) return false;
+
+    std::lock_guard<std::mutex> sessionLock(ctx.sessionMutex);
+    if (ctx.filename.empty()) ctx.filename = "recording.mp4";
+    ctx.isInitialized = false;
+    ctx.minPresetIndex = 0;
+    ctx.maxPresetIndex = ctx.presetIndex;
+    ctx.gopFrames = 0;
+    ctx.gopMaxQueueDepth = 0;
+    ctx.idleGops = 0;
+    ctx.videoCodecContext = encoder;
+
+    if (outputWidth != width || outputHeight != height) {
+        ctx.swsContext = createFrameScaler(width, height, outputWidth, outputHeight, ctx.scaleFlags, scalerThreads());
+        if (!ctx.swsContext) {
+            std::cerr << "Could not create SWS context\n";
+            return abortRecordingInit(ctx);
+        }
+    }
+
+    ctx.framePool = createFramePool(outputWidth, outputHeight);
+    if (!ctx.framePool) {
+        std::cerr << "Could not create frame pool\n";
+        return abortRecordingInit(ctx);
+    }
+
+    if (ctx.swsContext) {
+        ctx.convertedFrame = allocYUVFrame(width, height);
+        if (!ctx.convertedFrame) {
+            std::cerr << "Could not allocate conversion frame\n";
+            return abortRecordingInit(ctx);
+        }
+    }
+
+    ctx.videoParameters = avcodec_parameters_alloc();
+    if (!ctx.videoParameters ||
+        avcodec_parameters_from_context(ctx.videoParameters, ctx.videoCodecContext) < 0) {
+        std::cerr << "Could not copy video codec parameters\n";
+        return abortRecordingInit(ctx);
+    }
+
+    if (!ctx.audioSource.empty()) {
+        ctx.audio.source = createAudioSource(ctx.audioSource);
+        if (!ctx.audio.source || !openAudioPipeline(ctx.audio)) {
+            std::cerr << "Could not start audio capture\n";
+            return abortRecordingInit(ctx);
+        }
+    }
+
+    if (ctx.replaySeconds > 0) {
+        ctx.replay.maxDuration = av_rescale_q(ctx.replaySeconds, AVRational{1, 1},
+                                              VIDEO_TIME_BASE);
+        ctx.replay.maxBytes = static_cast<int64_t>(ctx.replaySeconds) * TARGET_BITRATE / 8 * 2;
+        ctx.replay.bytes = 0;
+    } else {
+        ctx.segmentIndex = 0;
+        ctx.segmentStartDts = 0;
+        if (ctx.lossless) ctx.spoolFilename = spoolFilename(ctx.filename);
+        std::string filename = ctx.lossless ? ctx.spoolFilename : segmentFilename(ctx);
+        ctx.formatContext = openOutputFile(filename, ctx.videoParameters,
+                                           VIDEO_TIME_BASE, &ctx.videoStream,
+                                           ctx.audio.parameters, &ctx.audioStream,
+                                           ctx.fragmented);
+        if (!ctx.formatContext) {
+            return abortRecordingInit(ctx);
+        }
+    }
+
+    ctx.inputWidth = width;
+    ctx.inputHeight = height;
+    resetTileDamage(ctx.damage, width, height);
+    ctx.lastVideoDts = AV_NOPTS_VALUE;
+    ctx.frameSlots.reserve(MAX_QUEUED_FRAMES + 4);
+    ctx.frameQueue.reserve(MAX_QUEUED_FRAMES + 1);
+    ctx.lastSlot = -1;
+    ctx.cursorPlanes.drawn = false;
+    ctx.convert = nullptr;
+    ctx.startTime = std::chrono::steady_clock::now();
+    ctx.lastPresetSwitch = ctx.startTime;
+    ctx.lastPts = -1;
+    ctx.lastSkippedPts = -1;
+    ctx.forceKeyframe = true;
+    ctx.capturedFrames = 0;
+    ctx.skippedFrames = 0;
+    ctx.lateFrames = 0;
+    ctx.duplicatedFrames = 0;
+    ctx.droppedFrames = 0;
+    ctx.stopEncoder = false;
+    ctx.encoderThread = std::thread(encoderLoop, std::ref(ctx));
+    if (ctx.audio.source) startAudioPipeline(ctx);
+    ctx.isInitialized = true;
+    return true;
+}
+
+struct CapturedFrame {
+    const uint8_t* data;
+    int stride;
+    int width;
+    int height;
+    PixelLayout layout;
+    const CursorImage* cursor;
+};
+
+struct FrameSource {
+    virtual ~FrameSource() {}
+    virtual bool grab(CapturedFrame& frame) = 0;
+    virtual void release() {}
+    virtual void idle() {}
+};
+
+struct X11FrameSource : FrameSource {
+    ScreenCapture& capture;
+    XImage* image;
+    PixelLayout layout;
+    bool layoutKnown;
+    bool unsupported;
+
+    explicit X11FrameSource(ScreenCapture& cap)
+        : capture(cap), image(nullptr), layout{}, layoutKnown(false), unsupported(false) {}
+
+    bool grab(CapturedFrame& frame) override {
+        if (unsupported) return false;
+        image = captureFrame(capture);
+        if (!image) return false;
+
+        if (!layoutKnown) {
+            if (!pixelLayoutFromImage(image, layout)) {
+                std::cerr << "Unsupported image format: " << image->bits_per_pixel << " bpp, masks "
+                          << std::hex << image->red_mask << "/" << image->green_mask << "/"
+                          << image->blue_mask << std::dec
+                          << (image->byte_order == MSBFirst ? " MSB first\n" : " LSB first\n");
+                release();
+                unsupported = true;
+                return false;
+            }
+            layoutKnown = true;
+        }
+
+        frame.data = reinterpret_cast<const uint8_t*>(image->data);
+        frame.stride = image->bytes_per_line;
+        frame.width = capture.width;
+        frame.height = capture.height;
+        frame.layout = layout;
+        frame.cursor = updateCursor(capture) ? &capture.cursor : nullptr;
+        return true;
+    }
+
+    void release() override {
+        releaseFrame(capture, image);
+        image = nullptr;
+    }
+
+    void idle() override {
+        if (capture.window || capture.cursor.enabled) processCaptureEvents(capture);
+    }
+};
+
+enum class SyntheticScene {
+    Static,
+    Scroll,
+    Motion,
+    Noise
+};
+
+struct SyntheticFrameSource : FrameSource {
+    SyntheticScene scene;
+    int width;
+    int height;
+    std::vector<uint32_t> pixels;
+    int64_t frameIndex;
+    uint32_t seed;
+
+    SyntheticFrameSource(SyntheticScene scene, int width, int height)
+        : scene(scene), width(width), height(height), pixels(width * height),
+          frameIndex(0), seed(2463534242u) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                pixels[y * width + x] = scene == SyntheticScene::Scroll ? textPixel(x, y) : gradientPixel(x, y);
+            }
+        }
+    }
+
+    uint32_t gradientPixel(int x, int y) const {
+        return 0xff000000u | ((x * 255 / width) << 16) | ((y * 255 / height) << 8) | 0x40;
+    }
+
+    int boxSize() const {
+        return std::min(160, std::min(width, height) / 4) & ~1;
+    }
+
+    void boxPosition(int64_t index, int& x, int& y) const {
+        int size = boxSize();
+        int rangeX = std::max(1, width - size);
+        int rangeY = std::max(1, height - size);
+        int64_t px = (index * 12) % (2 * rangeX);
+        int64_t py = (index * 7) % (2 * rangeY);
+        x = static_cast<int>(px < rangeX ? px : 2 * rangeX - px);
+        y = static_cast<int>(py < rangeY ? py : 2 * rangeY - py);
+    }
+
+    void drawBox(int64_t index, bool erase) {
+        int size = boxSize();
+        int left, top;
+        boxPosition(index, left, top);
+        for (int y = top; y < std::min(height, top + size); y++) {
+            for (int x = left; x < std::min(width, left + size); x++) {
+                bool light = (((x - left) / 8) + ((y - top) / 8)) & 1;
+                pixels[y * width + x] = erase ? gradientPixel(x, y) : light ? 0xfff0e0c0u : 0xff203060u;
+            }
+        }
+    }
+
+    static uint32_t textPixel(int x, int64_t line) {
+        const int lineHeight = 16;
+        const int glyphWidth = 8;
+        int row = static_cast<int>(line % lineHeight);
+        if (row < 2 || row > 13 || x % glyphWidth == 7) return 0xff1e1e1eu;
+
+        uint32_t glyph = static_cast<uint32_t>((line / lineHeight) * 131 + x / glyphWidth) * 2654435761u;
+        if ((glyph >> 28) == 0 || (x / glyphWidth) % 23 == 22) return 0xff1e1e1eu;
+        uint32_t bits = glyph >> ((row - 2) % 12 + 4);
+        return ((bits >> (x % glyphWidth)) & 1) ? 0xffd0d0d0u : 0xff1e1e1eu;
+    }
+
+    bool grab(CapturedFrame& frame) override {
+        const int scrollRows = 4;
+        if (scene == SyntheticScene::Scroll && frameIndex > 0) {
+            memmove(pixels.data(), pixels.data() + scrollRows * width,
+                    (height - scrollRows) * width * sizeof(uint32_t));
+            for (int y = height - scrollRows; y < height; y++) {
+                int64_t line = frameIndex * scrollRows + y;
+                for (int x = 0; x < width; x++) {
+                    pixels[y * width + x] = textPixel(x, line);
+                }
+            }
+        } else if (scene == SyntheticScene::Motion) {
+            if (frameIndex > 0) drawBox(frameIndex - 1, true);
+            drawBox(frameIndex, false);
+        } else if (scene == SyntheticScene::Noise) {
+            for (uint32_t& pixel : pixels) {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                pixel = 0xff000000u | (seed & 0x00ffffffu);
+            }
+        }
+        frameIndex++;
+
+        frame.data = reinterpret_cast<const uint8_t*>(pixels.data());
+        frame.stride = width * 4;
+        frame.width = width;
+        frame.height = height;
+        frame.layout = {32, 16, 8, 0};
+        frame.cursor = nullptr;
+        return true;
+    }
+};
+
+bool queueFrame(RecordingContext& ctx, int slot, int64_t pts) {
+    {
+        std::lock_guard<std::mutex> lock(ctx.queueMutex);
+        if (ctx.frameQueue.size() >= MAX_QUEUED_FRAMES) {
+            ctx.droppedFrames++;
+            return false;
+        }
+        ctx.frameQueue.push_back({ctx.frameSlots[slot].frame, slot, pts, ctx.forceKeyframe});
+        ctx.frameSlots[slot].users++;
+        ctx.forceKeyframe = false;
+        recordQueueDepth(static_cast<int>(ctx.frameQueue.size()));
+    }
+    ctx.queueCond.notify_one();
+    return true;
+}
+
+bool convertResizedCapture(RecordingContext& ctx, const CapturedFrame& captured, int width, int height,
+                           AVFrame* frame) {
+    if (!ctx.resizedFrame || ctx.resizedFrame->width != width || ctx.resizedFrame->height != height) {
+        if (ctx.resizedFrame) av_frame_free(&ctx.resizedFrame);
+        ctx.resizedFrame = allocYUVFrame(width, height);
+        if (!ctx.resizedFrame) return false;
+    }
+
+    {
+        StageTimer timer(PipelineStage::Convert);
+        convertToYUV420P(ctx.convert, captured.data, captured.stride, width, height, captured.layout,
+                         ctx.resizedFrame);
+        blendCursor(ctx.cursorPlanes, captured.cursor, ctx.resizedFrame, width, height);
+    }
+
+    StageTimer timer(PipelineStage::Scale);
+    ctx.resizeContext = sws_getCachedContext(ctx.resizeContext, width, height, AV_PIX_FMT_YUV420P,
+                                             frame->width, frame->height, AV_PIX_FMT_YUV420P,
+                                             ctx.scaleFlags, nullptr, nullptr, nullptr);
+    return ctx.resizeContext &&
+           sws_scale(ctx.resizeContext, ctx.resizedFrame->data, ctx.resizedFrame->linesize, 0, height,
+                     frame->data, frame->linesize) > 0;
+}
+
+void writeFrame(RecordingContext& ctx, const CapturedFrame& captured,
+                std::chrono::steady_clock::time_point captureTime) {
+    std::lock_guard<std::mutex> sessionLock(ctx.sessionMutex);
+    if (!ctx.isRecording || !ctx.isInitialized) return;
+
+    const uint8_t* data = captured.data;
+    int stride = captured.stride;
+    int width = captured.width & ~1;
+    int height = captured.height & ~1;
+    const PixelLayout& layout = captured.layout;
+
+    double elapsed = std::chrono::duration<double>(captureTime - ctx.startTime).count();
+    int64_t pts = std::llround(elapsed * TARGET_FPS);
+    if (pts <= ctx.lastPts || pts <= ctx.lastSkippedPts) return;
+    ctx.capturedFrames++;
+
+    {
+        std::lock_guard<std::mutex> lock(ctx.queueMutex);
+        if (ctx.frameQueue.size() >= MAX_QUEUED_FRAMES) {
+            ctx.droppedFrames++;
+            ctx.lastPts = pts;
+            return;
+        }
+    }
+
+    if (!ctx.convert) ctx.convert = selectPixelConverter(layout);
+    if (!ctx.convert) {
+        std::cerr << "No converter for " << layout.bitsPerPixel << " bpp capture\n";
+        return;
+    }
+
+    // A followed window that no longer matches the session size is scaled into the
+    // encoder size; tile state is rebuilt once it matches again.
+    bool resized = width != ctx.inputWidth || height != ctx.inputHeight;
+    if (resized) resetTileDamage(ctx.damage, ctx.inputWidth, ctx.inputHeight);
+
+    bool incremental = ctx.incremental && !resized;
+    if (!resized && (ctx.deduplicate || incremental)) {
+        int dirtyTiles = updateTileDamage(ctx.damage, data, stride, width, height, layout.bitsPerPixel / 8);
+        if (ctx.deduplicate && dirtyTiles == 0 && !cursorChanged(ctx.cursorPlanes, captured.cursor)) {
+            // A static screen still repeats its last frame every DEDUP_REPEAT_FRAMES so video dts
+            // keeps advancing; audio held for interleaving is then written, not piled up.
+            if (ctx.lastSlot >= 0 && pts - ctx.lastPts >= DEDUP_REPEAT_FRAMES &&
+                queueFrame(ctx, ctx.lastSlot, pts)) {
+                ctx.duplicatedFrames++;
+                ctx.lastPts = pts;
+                return;
+            }
+            ctx.skippedFrames++;
+            ctx.lastSkippedPts = pts;
+            return;
+        }
+        if (incremental) markCursorDamage(ctx.damage, ctx.cursorPlanes, captured.cursor);
+    }
+
+    if (!ctx.variableFrameRate && !ctx.deduplicate && ctx.lastSlot >= 0) {
+        for (int64_t missing = ctx.lastPts + 1; missing < pts; missing++) {
+            if (queueFrame(ctx, ctx.lastSlot, missing)) ctx.duplicatedFrames++;
+        }
+    }
+    ctx.lastPts = pts;
+
+    int slot = acquireFrameSlot(ctx);
+    if (slot < 0) {
+        std::cerr << "Could not allocate video frame data\n";
+        resetTileDamage(ctx.damage, ctx.inputWidth, ctx.inputHeight);
+        return;
+    }
+    AVFrame* frame = ctx.frameSlots[slot].frame;
+
+    AVFrame* converted = nullptr;
+    if (resized) {
+        if (!convertResizedCapture(ctx, captured, width, height, frame)) {
+            std::cerr << "Could not scale resized capture\n";
+            return;
+        }
+    } else {
+        StageTimer timer(PipelineStage::Convert);
+        converted = ctx.swsContext ? ctx.convertedFrame : frame;
+        if (incremental) {
+            if (!ctx.swsContext) refreshFrameSlot(ctx, slot, width, height);
+            convertDirtyTiles(ctx.convert, data, stride, width, height, layout, ctx.damage, converted);
+            telemetry.convertedTiles.fetch_add(ctx.damage.dirtyCount, std::memory_order_relaxed);
+        } else {
+            convertToYUV420P(ctx.convert, data, stride, width, height, layout, converted);
+        }
+        blendCursor(ctx.cursorPlanes, captured.cursor, converted, width, height);
+    }
+
+    if (converted && ctx.swsContext) {
+        StageTimer timer(PipelineStage::Scale);
+        // sws_scale_frame references both frames internally; those allocations belong to
+        // libswscale, not to the frame writer.
+        CountAllocations scaling(false);
+        if (sws_scale_frame(ctx.swsContext, frame, converted) < 0) {
+            std::cerr << "Could not scale frame\n";
+            return;
+        }
+    }
+
+    holdLastSlot(ctx, slot);
+    queueFrame(ctx, slot, pts);
+}
+
+// Drives writeFrame's incremental path without an encoder: queued frames are drained in an
+// uneven pattern and some are kept referenced for a while, as libavcodec does, so slots are
+// recycled while older ones are still in use. Every drained frame must match a full conversion.
+bool checkIncrementalQueue(SyntheticScene scene, const char* name, int width, int height) {
+    const int frames = 90;
+    const int heldFrames = 3;
+    RecordingContext ctx{};
+    ctx.incremental = true;
+    ctx.variableFrameRate = true;
+    ctx.inputWidth = width & ~1;
+    ctx.inputHeight = height & ~1;
+    ctx.framePool = createFramePool(ctx.inputWidth, ctx.inputHeight);
+    ctx.videoParameters = avcodec_parameters_alloc();
+    if (!ctx.framePool || !ctx.videoParameters) {
+        std::cerr << "Could not set up incremental queue check\n";
+        av_buffer_pool_uninit(&ctx.framePool);
+        avcodec_parameters_free(&ctx.videoParameters);
+        return false;
+    }
+    ctx.videoParameters->width = ctx.inputWidth;
+    ctx.videoParameters->height = ctx.inputHeight;
+    resetTileDamage(ctx.damage, ctx.inputWidth, ctx.inputHeight);
+    ctx.frameSlots.reserve(MAX_QUEUED_FRAMES + 4);
+    ctx.frameQueue.reserve(MAX_QUEUED_FRAMES + 1);
+    ctx.lastSlot = -1;
+    ctx.lastPts = -1;
+    ctx.lastSkippedPts = -1;
+    ctx.startTime = std::chrono::steady_clock::now();
+    ctx.isRecording = true;
+    ctx.isInitialized = true;
+
+    SyntheticFrameSource source(scene, width, height);
+    const std::chrono::nanoseconds period(1000000000LL / TARGET_FPS);
+    std::vector<AVFrame*> expected(frames, nullptr);
+    std::deque<AVFrame*> held;
+    int verified = 0;
+    bool ok = true;
+
+    auto drain = [&](size_t keep) {
+        while (ctx.frameQueue.size() > keep) {
+            QueuedFrame queued = ctx.frameQueue.front();
+            ctx.frameQueue.erase(ctx.frameQueue.begin());
+            if (!framesEqual(queued.frame, expected[queued.pts], ctx.inputWidth, ctx.inputHeight)) {
+                std::cerr << "Queued frame " << queued.pts << " differs from a full conversion\n";
+                ok = false;
+            }
+            verified++;
+            if (queued.pts % 4 == 0) {
+                AVFrame* reference = av_frame_alloc();
+                av_frame_ref(reference, queued.frame);
+                held.push_back(reference);
+            }
+            releaseFrameSlot(ctx, queued.slot);
+        }
+        while (held.size() > static_cast<size_t>(heldFrames)) {
+            av_frame_free(&held.front());
+            held.pop_front();
+        }
+    };
+
+    for (int i = 0; i < frames && ok; i++) {
+        CapturedFrame frame;
+        source.grab(frame);
+        expected[i] = allocYUVFrame(ctx.inputWidth, ctx.inputHeight);
+        convertToYUV420P(selectPixelConverter(frame.layout), frame.data, frame.stride, ctx.inputWidth,
+                         ctx.inputHeight, frame.layout, expected[i]);
+        writeFrame(ctx, frame, ctx.startTime + period * i);
+        drain((i * 5) % (MAX_QUEUED_FRAMES - 1));
+    }
+    drain(0);
+
+    printf("incremental queue %-7s %d frames, %d verified, %zu slots  %s\n", name, frames, verified,
+           ctx.frameSlots.size(), ok && verified == frames ? "ok" : "FAIL");
+    ok = ok && verified == frames;
+
+    for (AVFrame* frame : held) av_frame_free(&frame);
+    for (AVFrame* frame : expected) av_frame_free(&frame);
+    releaseFrameSlots(ctx);
+    av_buffer_pool_uninit(&ctx.framePool);
+    avcodec_parameters_free(&ctx.videoParameters);
+    return ok;
+}
+
+bool runIncrementalQueueChecks(int width, int height) {
+    bool ok = checkIncrementalQueue(SyntheticScene::Static, "static", width, height);
+    ok = checkIncrementalQueue(SyntheticScene::Scroll, "scroll", width, height) && ok;
+    return checkIncrementalQueue(SyntheticScene::Motion, "motion", width, height) && ok;
+}
+
+AVPixelFormat capturedPixelFormat(const PixelLayout& layout) {
+    const PixelKernel* kernel = findPixelKernel(layout);
+    return kernel ? kernel->avFormat : AV_PIX_FMT_NONE;
+}
+
+bool scaleRecordedPreview(PreviewBuffer& preview, RecordingContext& rec, uint8_t* const planes[3],
+                          const int strides[3]) {
+    std::lock_guard<std::mutex> sessionLock(rec.sessionMutex);
+    if (!rec.isInitialized || rec.lastSlot < 0) return false;
+
+    const AVFrame* recorded = rec.frameSlots[rec.lastSlot].frame;
+    preview.scaler = sws_getCachedContext(preview.scaler, recorded->width, recorded->height, AV_PIX_FMT_YUV420P,
+                                          preview.width, preview.height, AV_PIX_FMT_YUV420P,
+                                          SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    if (preview.scaler) {
+        sws_scale(preview.scaler, recorded->data, recorded->linesize, 0, recorded->height, planes, strides);
+    }
+    return true;
+}
+
+void updatePreview(PreviewBuffer& preview, RecordingContext& rec, const CapturedFrame& frame) {
+    StageTimer timer(PipelineStage::Preview);
+    int lumaSize = preview.width * preview.height;
+    preview.staging.resize(lumaSize * 3 / 2);
+    uint8_t* planes[3] = {preview.staging.data(), preview.staging.data() + lumaSize,
+                          preview.staging.data() + lumaSize + lumaSize / 4};
+    int strides[3] = {preview.width, preview.width / 2, preview.width / 2};
+
+    if (!rec.isRecording || !scaleRecordedPreview(preview, rec, planes, strides)) {
+        preview.scaler = sws_getCachedContext(preview.scaler, frame.width, frame.height,
+                                              capturedPixelFormat(frame.layout),
+                                              preview.width, preview.height, AV_PIX_FMT_YUV420P,
+                                              SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+        if (preview.scaler) {
+            const uint8_t* srcData[1] = { frame.data };
+            int srcLinesize[1] = { frame.stride };
+            sws_scale(preview.scaler, srcData, srcLinesize, 0, frame.height, planes, strides);
+        }
+    }
+    if (!preview.scaler) return;
+
+    std::lock_guard<std::mutex> lock(preview.mutex);
+    std::swap(preview.pixels, preview.staging);
+    if (!preview.updated && preview.eventType) {
+        SDL_Event event = {};
+        event.type = preview.eventType;
+        SDL_PushEvent(&event);
+    }
+    preview.updated = true;
+}
+
+void captureLoop(FrameSource& source, RecordingContext& rec, PreviewBuffer& preview,
+                 std::atomic<bool>& running) {
+    const std::chrono::nanoseconds period(1000000000LL / TARGET_FPS);
+    auto deadline = std::chrono::steady_clock::now();
+    auto nextPreview = deadline;
+
+    while (running) {
+        std::this_thread::sleep_until(deadline);
+        auto captureTime = std::chrono::steady_clock::now();
+
+        bool previewPaused = rec.isRecording && !preview.whileRecording;
+        bool wantPreview = preview.fps > 0 && !previewPaused && captureTime >= nextPreview;
+        CapturedFrame frame;
+        if ((rec.isRecording || wantPreview) && source.grab(frame)) {
+            if (rec.isRecording) {
+                writeFrame(rec, frame, captureTime);
+            }
+
+            if (wantPreview) {
+                updatePreview(preview, rec, frame);
+                nextPreview = captureTime + std::chrono::nanoseconds(1000000000LL / preview.fps) - period / 2;
+            }
+            source.release();
+        } else if (!rec.isRecording && !wantPreview) {
+            source.idle();
+        }
+
+        deadline += period;
+        auto now = std::chrono::steady_clock::now();
+        if (now > deadline) {
+            int64_t missed = (now - deadline) / period + 1;
+            deadline += period * missed;
+            if (rec.isRecording) rec.lateFrames += missed;
+        }
+    }
+}
+
+void cleanupRecording(RecordingContext& ctx) {
+    std::lock_guard<std::mutex> sessionLock(ctx.sessionMutex);
+    if (!ctx.isInitialized) return;
+
+    finalizeRecording(ctx);
+    releaseRecordingResources(ctx, false);
+
+    ctx.isRecording = false;
+    ctx.isInitialized = false;
+}
+
+void applyOptions(RecordingContext& ctx, const Options& options) {
+    ctx.isRecording = false;
+    ctx.isInitialized = false;
+    ctx.variableFrameRate = options.variableFrameRate;
+    ctx.deduplicate = options.deduplicate;
+    ctx.incremental = options.incremental;
+    ctx.replaySeconds = options.replaySeconds;
+    ctx.fragmented = options.fragmented;
+    ctx.segmentSeconds = options.segmentSeconds;
+    ctx.segmentMegabytes = options.segmentMegabytes;
+    ctx.scaleWidth = options.scaleWidth;
+    ctx.scaleHeight = options.scaleHeight;
+    ctx.scaleFlags = options.scaleFlags;
+    ctx.profile = &ENCODER_PROFILES[options.profile];
+    ctx.adaptive = options.adaptive;
+    ctx.audioSource = options.audioSource;
+    ctx.lossless = options.lossless && options.replaySeconds == 0;
+    if (ctx.lossless) {
+        ctx.adaptive = false;
+        ctx.segmentSeconds = 0;
+        ctx.segmentMegabytes = 0;
+    }
+    if (ctx.adaptive && ctx.profile->maxBFrames > 0) {
+        std::cerr << "--adaptive encodes without B-frames; profile " << ctx.profile->name
+                  << " would use " << ctx.profile->maxBFrames << "\n";
+    }
+}
+
+struct BenchResult {
+    std::string key;
+    double psnr;
+    double ssim;
+    double fps;
+};
+
+double planeSquaredError(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int width, int height) {
+    double squaredError = 0.0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* rowA = a + y * strideA;
+        const uint8_t* rowB = b + y * strideB;
+        int64_t rowError = 0;
+        for (int x = 0; x < width; x++) {
+            int diff = rowA[x] - rowB[x];
+            rowError += diff * diff;
+        }
+        squaredError += rowError;
+    }
+    return squaredError;
+}
+
+double planeSSIM(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int width, int height) {
+    const int window = 8;
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    double total = 0.0;
+    int windows = 0;
+    for (int top = 0; top + window <= height; top += window) {
+        for (int left = 0; left + window <= width; left += window) {
+            int64_t sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
+            for (int y = top; y < top + window; y++) {
+                for (int x = left; x < left + window; x++) {
+                    int pa = a[y * strideA + x];
+                    int pb = b[y * strideB + x];
+                    sumA += pa;
+                    sumB += pb;
+                    sumAA += pa * pa;
+                    sumBB += pb * pb;
+                    sumAB += pa * pb;
+                }
+            }
+            const double n = window * window;
+            double meanA = sumA / n;
+            double meanB = sumB / n;
+            double varA = sumAA / n - meanA * meanA;
+            double varB = sumBB / n - meanB * meanB;
+            double covariance = sumAB / n - meanA * meanB;
+            total += ((2 * meanA * meanB + c1) * (2 * covariance + c2)) /
+                     ((meanA * meanA + meanB * meanB + c1) * (varA + varB + c2));
+            windows++;
+        }
+    }
+    return windows ? total / windows : 1.0;
+}
+
+bool measureOutputQuality(const std::string& filename, SyntheticScene scene, int width, int height,
+                          double& psnr, double& ssim, int64_t& decodedFrames) {
+    AVFormatContext* input = nullptr;
+    if (avformat_open_input(&input, filename.c_str(), nullptr, nullptr) < 0) {
+        std::cerr << "Could not open " << filename << "\n";
+        return false;
+    }
+
+    int videoIndex = avformat_find_stream_info(input, nullptr) >= 0
+        ? av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0) : -1;
+    AVStream* stream = videoIndex >= 0 ? input->streams[videoIndex] : nullptr;
+    const AVCodec* decoder = stream ? avcodec_find_decoder(stream->codecpar->codec_id) : nullptr;
+    AVCodecContext* decoderContext = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+    if (!decoderContext || avcodec_parameters_to_context(decoderContext, stream->codecpar) < 0 ||
+        avcodec_open2(decoderContext, decoder, nullptr) < 0) {
+        std::cerr << "Could not open decoder for " << filename << "\n";
+        avcodec_free_context(&decoderContext);
+        avformat_close_input(&input);
+        return false;
+    }
+
+    int sourceWidth = width & ~1;
+    int sourceHeight = height & ~1;
+    int outputWidth = stream->codecpar->width;
+    int outputHeight = stream->codecpar->height;
+    SyntheticFrameSource reference(scene, width, height);
+    int64_t referenceIndex = -1;
+    AVFrame* expected = allocYUVFrame(outputWidth, outputHeight);
+    AVFrame* actual = allocYUVFrame(outputWidth, outputHeight);
+    SwsContext* referenceScaler = sws_getContext(sourceWidth, sourceHeight, AV_PIX_FMT_BGR0,
+                                                 outputWidth, outputHeight, AV_PIX_FMT_YUV420P,
+                                                 SWS_LANCZOS | SWS_ACCURATE_RND, nullptr, nullptr, nullptr);
+    SwsContext* decodedScaler = nullptr;
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+
+    double squaredError = 0.0;
+    double samples = 0.0;
+    double ssimSum = 0.0;
+    decodedFrames = 0;
+    bool ok = expected && actual && referenceScaler && packet && frame;
+    bool draining = false;
+    while (ok) {
+        if (!draining) {
+            int ret = av_read_frame(input, packet);
+            if (ret < 0) {
+                draining = true;
+                avcodec_send_packet(decoderContext, nullptr);
+            } else {
+                if (packet->stream_index == videoIndex) avcodec_send_packet(decoderContext, packet);
+                av_packet_unref(packet);
+            }
+        }
+
+        int received;
+        while ((received = avcodec_receive_frame(decoderContext, frame)) == 0) {
+            int64_t pts = av_rescale_q(frame->best_effort_timestamp, stream->time_base, VIDEO_TIME_BASE);
+            CapturedFrame source;
+            while (referenceIndex < pts) {
+                reference.grab(source);
+                referenceIndex++;
+            }
+            const uint8_t* sourceData[1] = { reinterpret_cast<const uint8_t*>(reference.pixels.data()) };
+            int sourceStride[1] = { width * 4 };
+            sws_scale(referenceScaler, sourceData, sourceStride, 0, sourceHeight, expected->data, expected->linesize);
+
+            decodedScaler = sws_getCachedContext(decodedScaler, frame->width, frame->height,
+                                                 static_cast<AVPixelFormat>(frame->format),
+                                                 outputWidth, outputHeight, AV_PIX_FMT_YUV420P,
+                                                 SWS_POINT, nullptr, nullptr, nullptr);
+            if (!decodedScaler) {
+                ok = false;
+                break;
+            }
+            sws_scale(decodedScaler, frame->data, frame->linesize, 0, frame->height, actual->data, actual->linesize);
+
+            for (int plane = 0; plane < 3; plane++) {
+                int planeWidth = plane ? outputWidth / 2 : outputWidth;
+                int planeHeight = plane ? outputHeight / 2 : outputHeight;
+                squaredError += planeSquaredError(actual->data[plane], actual->linesize[plane],
+                                                  expected->data[plane], expected->linesize[plane],
+                                                  planeWidth, planeHeight);
+                samples += static_cast<double>(planeWidth) * planeHeight;
+            }
+            ssimSum += planeSSIM(actual->data[0], actual->linesize[0], expected->data[0], expected->linesize[0],
+                                 outputWidth, outputHeight);
+            decodedFrames++;
+            av_frame_unref(frame);
+        }
+        if (draining && received == AVERROR_EOF) break;
+    }
+
+    if (decodedFrames == 0) ok = false;
+    double meanSquaredError = samples > 0 ? squaredError / samples : 0.0;
+    psnr = meanSquaredError > 0 ? std::min(MAX_PSNR_DB, 10.0 * std::log10(255.0 * 255.0 / meanSquaredError))
+                                : MAX_PSNR_DB;
+    ssim = decodedFrames ? ssimSum / decodedFrames : 0.0;
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    sws_freeContext(decodedScaler);
+    sws_freeContext(referenceScaler);
+    av_frame_free(&actual);
+    av_frame_free(&expected);
+    avcodec_free_context(&decoderContext);
+    avformat_close_input(&input);
+    return ok;
+}
+
+bool parseScene(const std::string& name, SyntheticScene& scene) {
+    if (name == "static") {
+        scene = SyntheticScene::Static;
+    } else if (name == "scroll") {
+        scene = SyntheticScene::Scroll;
+    } else if (name == "motion") {
+        scene = SyntheticScene::Motion;
+    } else if (name == "noise") {
+        scene = SyntheticScene::Noise;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string benchKey(const Options& options, const std::string& scene) {
+    char key[160];
+    snprintf(key, sizeof(key), "%s/%dx%d/%s/%s%s", scene.c_str(), options.benchWidth, options.benchHeight,
+             ENCODER_PROFILES[options.profile].name, options.lossless ? "lossless" : "h264",
+             options.incremental ? "/incremental" : "");
+    std::string result = key;
+    if (options.scaleWidth > 0) {
+        snprintf(key, sizeof(key), "/scale%dx%d", options.scaleWidth, options.scaleHeight);
+        result += key;
+    }
+    if (options.deduplicate) result += "/dedup";
+    return result;
+}
+
+std::vector<BenchResult> readBaselines(const std::string& path) {
+    std::vector<BenchResult> baselines;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        char key[256];
+        BenchResult baseline;
+        if (sscanf(line.c_str(), "%255s %lf %lf %lf", key, &baseline.psnr, &baseline.ssim, &baseline.fps) == 4) {
+            baseline.key = key;
+            baselines.push_back(baseline);
+        }
+    }
+    return baselines;
+}
+
+bool writeBaselines(const std::string& path, const std::vector<BenchResult>& results) {
+    std::vector<BenchResult> baselines = readBaselines(path);
+    for (const BenchResult& result : results) {
+        auto existing = std::find_if(baselines.begin(), baselines.end(),
+                                     [&](const BenchResult& baseline) { return baseline.key == result.key; });
+        if (existing != baselines.end()) {
+            *existing = result;
+        } else {
+            baselines.push_back(result);
+        }
+    }
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        std::cerr << "Could not write baseline file " << path << "\n";
+        return false;
+    }
+    out << "# key psnr_db ssim fps\n";
+    for (const BenchResult& baseline : baselines) {
+        char line[384];
+        snprintf(line, sizeof(line), "%s %.3f %.5f %.1f\n", baseline.key.c_str(), baseline.psnr,
+                 baseline.ssim, baseline.fps);
+        out << line;
+    }
+    std::cout << "Wrote " << results.size() << " baseline entries to " << path << "\n";
+    return true;
+}
+
+bool checkBaseline(const BenchResult& result, const std::vector<BenchResult>& baselines, double fpsTolerance) {
+    auto baseline = std::find_if(baselines.begin(), baselines.end(),
+                                 [&](const BenchResult& entry) { return entry.key == result.key; });
+    if (baseline == baselines.end()) {
+        std::cerr << result.key << ": no baseline entry, record one with --write-baseline\n";
+        return false;
+    }
+
+    double fpsChange = baseline->fps > 0 ? 100.0 * (result.fps - baseline->fps) / baseline->fps : 0.0;
+    printf("  vs baseline: PSNR %+.2f dB, SSIM %+.4f, throughput %+.1f%%\n",
+           result.psnr - baseline->psnr, result.ssim - baseline->ssim, fpsChange);
+
+    bool ok = true;
+    if (result.psnr < baseline->psnr - PSNR_REGRESSION_DB) {
+        std::cerr << result.key << ": PSNR regressed from " << baseline->psnr << " to " << result.psnr << " dB\n";
+        ok = false;
+    }
+    if (result.ssim < baseline->ssim - SSIM_REGRESSION) {
+        std::cerr << result.key << ": SSIM regressed from " << baseline->ssim << " to " << result.ssim << "\n";
+        ok = false;
+    }
+    if (fpsChange < -fpsTolerance) {
+        std::cerr << result.key << ": throughput regressed from " << baseline->fps << " to " << result.fps
+                  << " fps\n";
+        ok = false;
+    }
+    return ok;
+}
+
+void recordSyntheticFrames(RecordingContext& ctx, FrameSource& source, int frames, int warmupFrames) {
+    const std::chrono::nanoseconds period(1000000000LL / TARGET_FPS);
+    for (int i = 0; i < frames; i++) {
+        CapturedFrame frame;
+        {
+            StageTimer timer(PipelineStage::Capture);
+            source.grab(frame);
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(ctx.queueMutex);
+            while (ctx.frameQueue.size() >= MAX_QUEUED_FRAMES) {
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                lock.lock();
+            }
+        }
+
+        {
+            CountAllocations counting(i >= warmupFrames);
+            writeFrame(ctx, frame, ctx.startTime + period * i);
+        }
+        source.release();
+    }
+}
+
+bool benchmarkScene(const Options& options, SyntheticScene scene, const char* name, BenchResult& result) {
+    int width = options.benchWidth;
+    int height = options.benchHeight;
+    SyntheticFrameSource source(scene, width, height);
+
+    RecordingContext ctx{};
+    applyOptions(ctx, options);
+    ctx.replaySeconds = 0;
+    ctx.audioSource.clear();
+    ctx.filename = "bench.mp4";
+    ctx.isRecording = true;
+    if (!initRecording(ctx, width, height)) {
+        std::cerr << "Failed to start benchmark recording\n";
+        return false;
+    }
+
+    TelemetrySnapshot before = takeTelemetrySnapshot();
+    uint64_t poolAllocationsBefore = telemetry.poolAllocations.load();
+    uint64_t countedAllocationsBefore = telemetry.countedAllocations.load();
+    uint64_t convertedTilesBefore = telemetry.convertedTiles.load();
+    uint64_t copiedTilesBefore = telemetry.copiedTiles.load();
+    auto start = std::chrono::steady_clock::now();
+    recordSyntheticFrames(ctx, source, options.benchFrames, MAX_QUEUED_FRAMES);
+    uint64_t writerAllocations = telemetry.countedAllocations.load() - countedAllocationsBefore;
+
+    uint64_t frameSlots = ctx.frameSlots.size();
+    uint64_t tilesPerFrame = ctx.damage.dirty.size();
+    cleanupRecording(ctx);
+    releaseWarmEncoder(ctx);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::string outputFilename = ctx.lossless ? ctx.spoolFilename : ctx.filename;
+    std::ifstream output(outputFilename, std::ios::binary | std::ios::ate);
+    double outputBytes = output ? static_cast<double>(output.tellg()) : 0.0;
+    double mediaSeconds = static_cast<double>(options.benchFrames) / TARGET_FPS;
+
+    printf("Scene %s %dx%d -> %dx%d, %d frames\n", name, width, height,
+           options.scaleWidth > 0 ? options.scaleWidth : width & ~1,
+           options.scaleHeight > 0 ? options.scaleHeight : height & ~1, options.benchFrames);
+    printf("  throughput %.1f fps (%.2f s)\n", options.benchFrames / seconds, seconds);
+    TelemetrySnapshot after = takeTelemetrySnapshot();
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        StageSummary summary = summarizeStage(after, &before, stage);
+        if (summary.count == 0) continue;
+        printf("  %-8s p50 %7.2f ms  p90 %7.2f ms  p99 %7.2f ms  mean %7.2f ms\n",
+               STAGE_NAMES[stage], summary.p50Ms, summary.p90Ms, summary.p99Ms, summary.meanMs);
+    }
+    printf("  max queue depth %d\n", telemetry.maxQueueDepth.load());
+    uint64_t poolAllocations = telemetry.poolAllocations.load() - poolAllocationsBefore;
+    printf("  pool buffer allocations %llu\n", static_cast<unsigned long long>(poolAllocations));
+    if (ALLOCATION_COUNTING) {
+        printf("  frame writer heap allocations %llu after %d warm-up frames\n",
+               static_cast<unsigned long long>(writerAllocations), static_cast<int>(MAX_QUEUED_FRAMES));
+    } else {
+        printf("  frame writer heap allocations not counted (build with -DCOUNT_ALLOCATIONS=1 on glibc)\n");
+    }
+    uint64_t convertedTiles = telemetry.convertedTiles.load() - convertedTilesBefore;
+    uint64_t copiedTiles = telemetry.copiedTiles.load() - copiedTilesBefore;
+    if (options.incremental) {
+        printf("  tiles per frame: %.1f converted, %.1f copied of %llu (%llu frame slots)\n",
+               static_cast<double>(convertedTiles) / options.benchFrames,
+               static_cast<double>(copiedTiles) / options.benchFrames,
+               static_cast<unsigned long long>(tilesPerFrame), static_cast<unsigned long long>(frameSlots));
+    }
+    printf("  peak RSS %.1f MB\n", usage.ru_maxrss / 1024.0);
+    printf("  output %.2f MB, %.0f kbit/s\n", outputBytes / (1024 * 1024),
+           outputBytes * 8 / 1000 / mediaSeconds);
+
+    result.fps = options.benchFrames / seconds;
+    int64_t decodedFrames = 0;
+    if (!measureOutputQuality(outputFilename, scene, width, height, result.psnr, result.ssim, decodedFrames)) {
+        std::cerr << "Could not measure output quality of " << outputFilename << "\n";
+        return false;
+    }
+    printf("  quality PSNR %.2f dB, SSIM %.4f over %lld decoded frames\n", result.psnr, result.ssim,
+           static_cast<long long>(decodedFrames));
+
+    const uint64_t maxPoolAllocations = MAX_QUEUED_FRAMES + 4;
+    if (poolAllocations > maxPoolAllocations) {
+        std::cerr << "Frame pool grew to " << poolAllocations << " buffers, expected at most "
+                  << maxPoolAllocations << "\n";
+        return false;
+    }
+
+    if (writerAllocations > 0) {
+        std::cerr << "Frame writer made " << writerAllocations << " heap allocations after warm-up, expected none\n";
+        return false;
+    }
+
+    uint64_t maxCopiedTiles = frameSlots * tilesPerFrame + (frameSlots > 0 ? frameSlots - 1 : 0) * convertedTiles;
+    if (copiedTiles > maxCopiedTiles) {
+        std::cerr << "Incremental conversion copied " << copiedTiles << " tiles, expected at most "
+                  << maxCopiedTiles << "\n";
+        return false;
+    }
+    return true;
+}
+
+int runPipelineBenchmark(const Options& options) {
+    std::vector<std::string> scenes;
+    if (options.benchScene == "all") {
+        scenes = {"static", "scroll", "motion", "noise"};
+    } else {
+        scenes.push_back(options.benchScene);
+    }
+
+    std::vector<BenchResult> baselines;
+    if (!options.baselineFile.empty()) {
+        baselines = readBaselines(options.baselineFile);
+        if (baselines.empty()) {
+            std::cerr << "No baselines in " << options.baselineFile << "\n";
+            return 1;
+        }
+    }
+
+    bool ok = true;
+    std::vector<BenchResult> results;
+    for (const std::string& name : scenes) {
+        SyntheticScene scene;
+        if (!parseScene(name, scene)) {
+            std::cerr << "Unknown bench scene: " << name << " (static, scroll, motion, noise, all)\n";
+            return 1;
+        }
+
+        BenchResult result = {benchKey(options, name), 0.0, 0.0, 0.0};
+        if (!benchmarkScene(options, scene, name.c_str(), result)) {
+            ok = false;
+            continue;
+        }
+        if (!baselines.empty()) ok = checkBaseline(result, baselines, options.fpsTolerance) && ok;
+        results.push_back(result);
+    }
+
+    if (!options.writeBaselineFile.empty()) {
+        if (!ok) {
+            std::cerr << "Not writing baselines from a failing run\n";
+        } else if (!writeBaselines(options.writeBaselineFile, results)) {
+            ok = false;
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+void recordUntilKilled(const Options& options, SyntheticScene scene, const std::string& filename) {
+    SyntheticFrameSource source(scene, options.benchWidth, options.benchHeight);
+    RecordingContext ctx{};
+    applyOptions(ctx, options);
+    ctx.replaySeconds = 0;
+    ctx.segmentSeconds = 0;
+    ctx.segmentMegabytes = 0;
+    ctx.lossless = false;
+    ctx.fragmented = true;
+    ctx.audioSource.clear();
+    ctx.filename = filename;
+    ctx.isRecording = true;
+    if (!initRecording(ctx, options.benchWidth, options.benchHeight)) {
+        std::cerr << "Failed to start crash test recording\n";
+        _exit(1);
+    }
+
+    const std::chrono::nanoseconds period(1000000000LL / TARGET_FPS);
+    for (int i = 0; i < CRASH_TEST_SECONDS * 4 * TARGET_FPS; i++) {
+        std::this_thread::sleep_until(ctx.startTime + period * i);
+        CapturedFrame frame;
+        source.grab(frame);
+        writeFrame(ctx, frame, ctx.startTime + period * i);
+        source.release();
+    }
+    _exit(1);
+}
+
+int runCrashRecoveryTest(const Options& options) {
+    std::string name = options.benchScene.empty() ? "motion" : options.benchScene;
+    SyntheticScene scene;
+    if (!parseScene(name, scene)) {
+        std::cerr << "Unknown bench scene: " << name << " (static, scroll, motion, noise)\n";
+        return 1;
+    }
+    std::string filename = "crash-test.mp4";
+    std::remove(filename.c_str());
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+        std::cerr << "Could not fork recorder: " << strerror(errno) << "\n";
+        return 1;
+    }
+    if (child == 0) recordUntilKilled(options, scene, filename);
+
+    std::this_thread::sleep_for(std::chrono::seconds(CRASH_TEST_SECONDS));
+    int status = 0;
+    if (waitpid(child, &status, WNOHANG) == child) {
+        std::cerr << "Recorder exited before it was killed\n";
+        return 1;
+    }
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+
+    std::ifstream output(filename, std::ios::binary | std::ios::ate);
+    double outputBytes = output ? static_cast<double>(output.tellg()) : 0.0;
+    printf("Killed recorder after %d s, %s is %.2f MB\n", CRASH_TEST_SECONDS, filename.c_str(),
+           outputBytes / (1024 * 1024));
+
+    double psnr = 0.0;
+    double ssim = 0.0;
+    int64_t decodedFrames = 0;
+    if (!measureOutputQuality(filename, scene, options.benchWidth, options.benchHeight, psnr, ssim,
+                              decodedFrames)) {
+        std::cerr << "Partial recording " << filename << " does not decode\n";
+        return 1;
+    }
+    printf("  decoded %lld frames, PSNR %.2f dB, SSIM %.4f\n", static_cast<long long>(decodedFrames), psnr, ssim);
+    if (psnr < CRASH_TEST_MIN_PSNR_DB) {
+        std::cerr << "Partial recording decodes with PSNR " << psnr << " dB, expected at least "
+                  << CRASH_TEST_MIN_PSNR_DB << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+int runSessionRestartTest(const Options& options) {
+    std::string name = options.benchScene.empty() ? "motion" : options.benchScene;
+    SyntheticScene scene;
+    if (!parseScene(name, scene)) {
+        std::cerr << "Unknown bench scene: " << name << " (static, scroll, motion, noise)\n";
+        return 1;
+    }
 
-const int TARGET_WIDTH = 1920;
-const int TARGET_HEIGHT = 1080;
-const int TARGET_FPS = 30;
-const int TARGET_BITRATE = 8000000;
-const char* TARGET_FORMAT = "mp4";
+    RecordingContext ctx{};
+    applyOptions(ctx, options);
+    ctx.replaySeconds = 0;
+    ctx.segmentSeconds = 0;
+    ctx.segmentMegabytes = 0;
+    ctx.lossless = false;
+    ctx.variableFrameRate = false;
+    ctx.deduplicate = false;
+    ctx.audioSource.clear();
+    int width = options.benchWidth;
+    int height = options.benchHeight;
+    prewarmInBackground(ctx, width, height);
 
-struct Button {
-    SDL_Rect rect;
-    std::string label;
-    bool isHovered;
-    bool isPressed;
-};
+    bool ok = true;
+    for (int session = 1; session <= 2 && ok; session++) {
+        SyntheticFrameSource source(scene, width, height);
+        ctx.filename = "restart-" + std::to_string(session) + ".mp4";
+        ctx.isRecording = true;
+        if (!initRecording(ctx, width, height)) {
+            std::cerr << "Failed to start session " << session << "\n";
+            ctx.isRecording = false;
+            ok = false;
+            break;
+        }
+        recordSyntheticFrames(ctx, source, options.benchFrames, options.benchFrames);
+        cleanupRecording(ctx);
+        prewarmInBackground(ctx, width, height);
 
-struct RecordingContext {
-    AVFormatContext* formatContext;
-    AVCodecContext* videoCodecContext;
-    AVStream* videoStream;
-    SwsContext* swsContext;
-    std::atomic<bool> isRecording;
-    std::atomic<bool> isInitialized;
+        double psnr = 0.0;
+        double ssim = 0.0;
+        int64_t decodedFrames = 0;
+        if (!measureOutputQuality(ctx.filename, scene, width, height, psnr, ssim, decodedFrames)) {
+            std::cerr << "Session " << session << " output " << ctx.filename << " does not decode\n";
+            ok = false;
+            break;
+        }
+        printf("Session %d (%s profile): %s decoded %lld of %d frames, PSNR %.2f dB, SSIM %.4f\n", session,
+               ctx.profile->name, ctx.filename.c_str(), static_cast<long long>(decodedFrames), options.benchFrames,
+               psnr, ssim);
+        if (decodedFrames != options.benchFrames || psnr < CRASH_TEST_MIN_PSNR_DB) {
+            std::cerr << "Session " << session << " lost frames or decodes with PSNR " << psnr << " dB\n";
+            ok = false;
+        }
+    }
+
+    releaseWarmEncoder(ctx);
+    return ok ? 0 : 1;
+}
+
+struct TranscodeChunk {
+    int64_t start;
+    int64_t end;
     std::string filename;
-    int64_t videoFrameNumber;
-    AVFrame* videoFrame;
-    std::vector<uint8_t> frameBuffer;
+    AVCodecParameters* parameters;
+    int64_t frames;
+    bool ok;
 };
 
-bool initSDL(SDL_Window** window, SDL_Renderer** renderer) {
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        std::cerr << "SDL_Init Error: " << SDL_GetError() << std::endl;
+bool encodeToFile(AVCodecContext* encoder, const AVFrame* frame, AVPacket* pkt,
+                  AVFormatContext* output, AVStream* stream) {
+    if (avcodec_send_frame(encoder, frame) < 0) {
+        std::cerr << "Error sending frame to encoder\n";
         return false;
     }
+    while (avcodec_receive_packet(encoder, pkt) == 0) {
+        av_packet_rescale_ts(pkt, VIDEO_TIME_BASE, stream->time_base);
+        pkt->stream_index = stream->index;
+        if (av_interleaved_write_frame(output, pkt) < 0) {
+            std::cerr << "Error writing video packet\n";
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (TTF_Init() == -1) {
-        std::cerr << "TTF_Init Error: " << TTF_GetError() << std::endl;
-        SDL_Quit();
-        return false;
+void transcodeChunk(const std::string& spool, const EncoderProfile& profile, int threads, TranscodeChunk& chunk) {
+    chunk.ok = false;
+    chunk.frames = 0;
+    AVFormatContext* input = nullptr;
+    if (avformat_open_input(&input, spool.c_str(), nullptr, nullptr) < 0) {
+        std::cerr << "Could not open spool " << spool << "\n";
+        return;
     }
 
-    *window = SDL_CreateWindow("Wumbo Recorder",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
-    if (!*window) {
-        std::cerr << "Window error: " << SDL_GetError() << std::endl;
-        TTF_Quit();
-        SDL_Quit();
-        return false;
+    int videoIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    AVStream* stream = videoIndex >= 0 ? input->streams[videoIndex] : nullptr;
+    const AVCodec* decoder = stream ? avcodec_find_decoder(stream->codecpar->codec_id) : nullptr;
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    AVCodecContext* decoderContext = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+    AVCodecContext* encoderContext = nullptr;
+    AVFormatContext* output = nullptr;
+    AVStream* outputStream = nullptr;
+    AVStream* noAudio = nullptr;
+    AVPacket* packet = av_packet_alloc();
+    AVPacket* encoded = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+
+    if (!decoderContext || avcodec_parameters_to_context(decoderContext, stream->codecpar) < 0 ||
+        avcodec_open2(decoderContext, decoder, nullptr) < 0) {
+        std::cerr << "Could not open spool decoder\n";
+    } else if (!encoder ||
+               !(encoderContext = openH264Encoder(profile, profile.preset, 0, true, false, threads, encoder,
+                                                  stream->codecpar->width, stream->codecpar->height))) {
+        std::cerr << "Could not open chunk encoder\n";
+    } else if (!(chunk.parameters = avcodec_parameters_alloc()) ||
+               avcodec_parameters_from_context(chunk.parameters, encoderContext) < 0 ||
+               !(output = openOutputFile(chunk.filename, chunk.parameters, VIDEO_TIME_BASE, &outputStream,
+                                         nullptr, &noAudio, false))) {
+        std::cerr << "Could not open chunk " << chunk.filename << "\n";
+    } else {
+        av_seek_frame(input, videoIndex, av_rescale_q(chunk.start, VIDEO_TIME_BASE, stream->time_base),
+                      AVSEEK_FLAG_BACKWARD);
+        chunk.ok = true;
+        bool done = false;
+        while (chunk.ok && !done && av_read_frame(input, packet) >= 0) {
+            if (packet->stream_index == videoIndex && avcodec_send_packet(decoderContext, packet) >= 0) {
+                while (avcodec_receive_frame(decoderContext, frame) == 0) {
+                    int64_t pts = av_rescale_q(frame->best_effort_timestamp, stream->time_base, VIDEO_TIME_BASE);
+                    if (pts >= chunk.end) done = true;
+                    if (!done && pts >= chunk.start) {
+                        frame->pts = pts;
+                        frame->pict_type = AV_PICTURE_TYPE_NONE;
+                        chunk.ok = encodeToFile(encoderContext, frame, encoded, output, outputStream);
+                        chunk.frames++;
+                    }
+                    av_frame_unref(frame);
+                }
+            }
+            av_packet_unref(packet);
+        }
+        chunk.ok = chunk.ok && encodeToFile(encoderContext, nullptr, encoded, output, outputStream);
+        closeOutputFile(output);
     }
 
-    *renderer = SDL_CreateRenderer(*window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-    if (!*renderer) {
-        std::cerr << "Renderer error: " << SDL_GetError() << std::endl;
-        SDL_DestroyWindow(*window);
-        TTF_Quit();
-        SDL_Quit();
+    av_frame_free(&frame);
+    av_packet_free(&encoded);
+    av_packet_free(&packet);
+    if (encoderContext) avcodec_free_context(&encoderContext);
+    if (decoderContext) avcodec_free_context(&decoderContext);
+    avformat_close_input(&input);
+}
+
+bool appendChunk(const TranscodeChunk& chunk, AVFormatContext* output, AVStream* videoStream,
+                 AVFormatContext* audioInput, int audioIndex, AVStream* audioStream,
+                 AVPacket* audioPacket, bool& audioPending) {
+    AVFormatContext* input = nullptr;
+    if (avformat_open_input(&input, chunk.filename.c_str(), nullptr, nullptr) < 0) {
+        std::cerr << "Could not reopen chunk " << chunk.filename << "\n";
         return false;
     }
 
+    AVPacket* packet = av_packet_alloc();
+    while (av_read_frame(input, packet) >= 0) {
+        AVRational timeBase = input->streams[packet->stream_index]->time_base;
+        while (audioPending && av_compare_ts(audioPacket->dts, audioInput->streams[audioIndex]->time_base,
+                                             packet->dts, timeBase) <= 0) {
+            av_packet_rescale_ts(audioPacket, audioInput->streams[audioIndex]->time_base, audioStream->time_base);
+            audioPacket->stream_index = audioStream->index;
+            av_interleaved_write_frame(output, audioPacket);
+            audioPending = av_read_frame(audioInput, audioPacket) >= 0;
+        }
+
+        av_packet_rescale_ts(packet, timeBase, videoStream->time_base);
+        packet->stream_index = videoStream->index;
+        if (av_interleaved_write_frame(output, packet) < 0) {
+            std::cerr << "Error writing video packet\n";
+        }
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&input);
     return true;
 }
 
-bool finalizeRecording(RecordingContext& ctx) {
-    if (!ctx.isInitialized) return false;
-
-    const AVOutputFormat* outputFormat = av_guess_format("mp4", nullptr, nullptr);
-    if (!outputFormat) {
-        std::cerr << "Could not find MP4 output format\n";
+bool transcodeSpool(const std::string& spool, const std::string& filename, const EncoderProfile& profile) {
+    auto start = std::chrono::steady_clock::now();
+    AVFormatContext* input = nullptr;
+    if (avformat_open_input(&input, spool.c_str(), nullptr, nullptr) < 0) {
+        std::cerr << "Could not open spool " << spool << "\n";
         return false;
     }
-
-    if (avformat_alloc_output_context2(&ctx.formatContext, 
-                                     const_cast<AVOutputFormat*>(outputFormat), 
-                                     nullptr, ctx.filename.c_str()) < 0) {
-        std::cerr << "Could not create output context\n";
+    int videoIndex = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    int audioIndex = av_find_best_stream(input, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    int64_t totalFrames = input->duration > 0 ? av_rescale_q(input->duration, AV_TIME_BASE_Q, VIDEO_TIME_BASE) + 1 : 0;
+    if (videoIndex < 0 || totalFrames <= 0) {
+        std::cerr << "Spool " << spool << " has no video to transcode\n";
+        avformat_close_input(&input);
         return false;
     }
 
-    ctx.videoStream = avformat_new_stream(ctx.formatContext, nullptr);
-    if (!ctx.videoStream) {
-        std::cerr << "Could not create video stream\n";
-        return false;
+    int workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    int64_t chunkFrames = (totalFrames + workers - 1) / workers;
+    chunkFrames = (chunkFrames + profile.gopSize - 1) / profile.gopSize * profile.gopSize;
+    std::string base = filename.substr(0, filename.rfind('.'));
+    std::vector<TranscodeChunk> chunks;
+    for (int64_t first = 0; first < totalFrames; first += chunkFrames) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".part%03d.mkv", static_cast<int>(chunks.size()));
+        chunks.push_back({first, first + chunkFrames, base + suffix, nullptr, 0, false});
     }
+    chunks.back().end = INT64_MAX;
 
-    if (avcodec_parameters_from_context(ctx.videoStream->codecpar, ctx.videoCodecContext) < 0) {
-        std::cerr << "Could not copy video codec parameters\n";
-        return false;
+    // Chunks already run one per core; each encoder gets its share of the cores instead of
+    // x264's own per-core default, which would start cores * cores threads.
+    int encoderThreads = std::max(1, workers / static_cast<int>(chunks.size()));
+    std::vector<std::thread> threads;
+    for (TranscodeChunk& chunk : chunks) {
+        threads.emplace_back(transcodeChunk, std::cref(spool), std::cref(profile), encoderThreads, std::ref(chunk));
     }
+    for (std::thread& thread : threads) thread.join();
 
-    if (!(ctx.formatContext->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&ctx.formatContext->pb, ctx.filename.c_str(), AVIO_FLAG_WRITE) < 0) {
-            std::cerr << "Could not open output file\n";
-            return false;
+    bool ok = true;
+    int64_t frames = 0;
+    for (const TranscodeChunk& chunk : chunks) {
+        ok = ok && chunk.ok;
+        frames += chunk.frames;
+    }
+
+    AVStream* videoStream = nullptr;
+    AVStream* audioStream = nullptr;
+    AVFormatContext* output = nullptr;
+    if (ok) {
+        input->streams[videoIndex]->discard = AVDISCARD_ALL;
+        output = openOutputFile(filename, chunks.front().parameters, VIDEO_TIME_BASE, &videoStream,
+                                audioIndex >= 0 ? input->streams[audioIndex]->codecpar : nullptr,
+                                &audioStream, false);
+        ok = output != nullptr;
+    }
+    if (ok) {
+        AVPacket* audioPacket = av_packet_alloc();
+        bool audioPending = audioStream && av_read_frame(input, audioPacket) >= 0;
+        for (const TranscodeChunk& chunk : chunks) {
+            ok = ok && appendChunk(chunk, output, videoStream, input, audioIndex, audioStream, audioPacket, audioPending);
         }
+        while (audioPending) {
+            av_packet_rescale_ts(audioPacket, input->streams[audioIndex]->time_base, audioStream->time_base);
+            audioPacket->stream_index = audioStream->index;
+            av_interleaved_write_frame(output, audioPacket);
+            audioPending = av_read_frame(input, audioPacket) >= 0;
+        }
+        av_packet_free(&audioPacket);
+        closeOutputFile(output);
     }
 
-    if (avformat_write_header(ctx.formatContext, nullptr) < 0) {
-        std::cerr << "Could not write header\n";
+    for (TranscodeChunk& chunk : chunks) {
+        if (chunk.parameters) avcodec_parameters_free(&chunk.parameters);
+        std::remove(chunk.filename.c_str());
+    }
+    avformat_close_input(&input);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!ok) {
+        std::cerr << "Transcode of " << spool << " failed\n";
         return false;
     }
+    printf("Transcoded %s to %s: %lld frames in %zu chunks, %.1f s (%.1f fps)\n", spool.c_str(),
+           filename.c_str(), static_cast<long long>(frames), chunks.size(), seconds, frames / seconds);
+    return true;
+}
+
+struct TranscodeWorker {
+    std::thread thread;
+    std::shared_ptr<std::atomic<bool>> done;
+};
+
+void transcodeInBackground(std::vector<TranscodeWorker>& workers, const std::string& spool,
+                           const EncoderProfile* profile) {
+    for (auto it = workers.begin(); it != workers.end();) {
+        if (*it->done) {
+            it->thread.join();
+            it = workers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    auto done = std::make_shared<std::atomic<bool>>(false);
+    std::thread thread([spool, profile, done] {
+        if (transcodeSpool(spool, transcodeFilename(spool), *profile)) std::remove(spool.c_str());
+        *done = true;
+    });
+    workers.push_back({std::move(thread), done});
+}
 
-    size_t frameSize = av_image_get_buffer_size(ctx.videoCodecContext->pix_fmt,
-                                              ctx.videoCodecContext->width,
-                                              ctx.videoCodecContext->height, 1);
-    size_t frameCount = ctx.frameBuffer.size() / frameSize;
+void joinTranscodes(std::vector<TranscodeWorker>& workers) {
+    if (workers.empty()) return;
+    std::cout << "Waiting for " << workers.size() << " transcode(s) to finish\n";
+    for (TranscodeWorker& worker : workers) worker.thread.join();
+    workers.clear();
+}
 
-    for (size_t i = 0; i < frameCount; i++) {
-        const uint8_t* frameData = ctx.frameBuffer.data() + i * frameSize;
-        
-        av_image_fill_arrays(ctx.videoFrame->data, ctx.videoFrame->linesize,
-                           frameData, ctx.videoCodecContext->pix_fmt,
-                           ctx.videoCodecContext->width, ctx.videoCodecContext->height, 1);
-        
-        ctx.videoFrame->pts = i;
+int runAudioDriftBenchmark() {
+    const double skews[] = {0.0, 0.0005, -0.0005, 0.002, -0.002};
+    const int seconds = 600;
+    const int settleSeconds = 10;
+    bool passed = true;
 
-        AVPacket* pkt = av_packet_alloc();
-        if (avcodec_send_frame(ctx.videoCodecContext, ctx.videoFrame) < 0) {
-            std::cerr << "Error sending frame to encoder\n";
-            av_packet_free(&pkt);
-            continue;
+    printf("A/V drift over %d s of synthetic audio\n", seconds);
+    for (double skew : skews) {
+        AudioPipeline audio{};
+        audio.source.reset(new SineAudioSource(false));
+        if (!openAudioPipeline(audio)) {
+            closeAudioPipeline(audio);
+            return 1;
         }
 
-        while (true) {
-            int ret = avcodec_receive_packet(ctx.videoCodecContext, pkt);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
-            if (ret < 0) {
-                std::cerr << "Error receiving packet\n";
+        int frameSize = audio.codecContext->frame_size;
+        double deviceRate = AUDIO_SAMPLE_RATE * (1.0 + skew);
+        int64_t totalFrames = static_cast<int64_t>(seconds * deviceRate);
+        int64_t frames = 0;
+        int64_t maxDrift = 0;
+        int64_t drift = 0;
+        AudioChunk chunk;
+        while (frames < totalFrames) {
+            chunk.captureMicros = std::llround(frames / deviceRate * 1000000);
+            chunk.frames = audio.source->read(chunk.samples, AUDIO_CHUNK_FRAMES);
+            frames += chunk.frames;
+            if (!resampleAudioChunk(audio, chunk)) {
+                passed = false;
                 break;
             }
 
-            av_packet_rescale_ts(pkt, ctx.videoCodecContext->time_base, ctx.videoStream->time_base);
-            pkt->stream_index = ctx.videoStream->index;
-            if (av_interleaved_write_frame(ctx.formatContext, pkt) < 0) {
-                std::cerr << "Error writing video packet\n";
-            }
-            av_packet_unref(pkt);
+            int whole = av_audio_fifo_size(audio.fifo) / frameSize * frameSize;
+            av_audio_fifo_drain(audio.fifo, whole);
+            audio.nextPts += whole;
+
+            int64_t expected = std::llround(frames / deviceRate * AUDIO_SAMPLE_RATE);
+            int64_t produced = audio.nextPts + av_audio_fifo_size(audio.fifo) +
+                               swr_get_delay(audio.swrContext, AUDIO_SAMPLE_RATE);
+            drift = produced - expected;
+            if (frames / deviceRate >= settleSeconds) maxDrift = std::max(maxDrift, drift < 0 ? -drift : drift);
         }
-        av_packet_free(&pkt);
-    }
 
-    AVPacket* pkt = av_packet_alloc();
-    avcodec_send_frame(ctx.videoCodecContext, nullptr);
-    while (avcodec_receive_packet(ctx.videoCodecContext, pkt) >= 0) {
-        av_packet_rescale_ts(pkt, ctx.videoCodecContext->time_base, ctx.videoStream->time_base);
-        pkt->stream_index = ctx.videoStream->index;
-        av_interleaved_write_frame(ctx.formatContext, pkt);
-        av_packet_unref(pkt);
+        bool ok = maxDrift < frameSize;
+        passed = passed && ok;
+        printf("  clock skew %+.2f%%: final drift %+.2f ms, max %.2f ms (limit %.2f ms) %s\n",
+               skew * 100, drift * 1000.0 / AUDIO_SAMPLE_RATE, maxDrift * 1000.0 / AUDIO_SAMPLE_RATE,
+               frameSize * 1000.0 / AUDIO_SAMPLE_RATE, ok ? "ok" : "FAIL");
+        closeAudioPipeline(audio);
     }
-    av_packet_free(&pkt);
+    return passed ? 0 : 1;
+}
 
-    av_write_trailer(ctx.formatContext);
+struct ControlClient {
+    int fd;
+    std::string pending;
+};
 
-    if (!(ctx.formatContext->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&ctx.formatContext->pb);
-    }
+struct Daemon {
+    RecordingContext& rec;
+    ScreenCapture& capture;
+    TelemetrySnapshot lastSnapshot;
+    std::vector<TranscodeWorker> transcodes;
+    bool running;
+};
 
-    return true;
+double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
-void drawButton(SDL_Renderer* renderer, Button& button, TTF_Font* font) {
-    SDL_SetRenderDrawColor(renderer, 
-        button.isHovered ? BUTTON_HOVER_COLOR.r : BUTTON_COLOR.r,
-        button.isHovered ? BUTTON_HOVER_COLOR.g : BUTTON_COLOR.g,
-        button.isHovered ? BUTTON_HOVER_COLOR.b : BUTTON_COLOR.b,
-        255);
-    SDL_RenderFillRect(renderer, &button.rect);
-
-    SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
-    SDL_RenderDrawRect(renderer, &button.rect);
+std::string handleControlCommand(Daemon& daemon, const std::string& line) {
+    std::string command = line.substr(0, line.find(' '));
+    std::string argument = command.size() < line.size() ? line.substr(command.size() + 1) : "";
+    RecordingContext& rec = daemon.rec;
+    char reply[512];
 
-    SDL_Surface* textSurface = TTF_RenderText_Solid(font, button.label.c_str(), BUTTON_TEXT_COLOR);
-    if (textSurface) {
-        SDL_Texture* textTexture = SDL_CreateTextureFromSurface(renderer, textSurface);
-        if (textTexture) {
-            int textW = textSurface->w;
-            int textH = textSurface->h;
-            SDL_Rect textRect = {
-                button.rect.x + (button.rect.w - textW) / 2,
-                button.rect.y + (button.rect.h - textH) / 2,
-                textW,
-                textH
-            };
-            SDL_RenderCopy(renderer, textTexture, NULL, &textRect);
-            SDL_DestroyTexture(textTexture);
+    if (command == "start") {
+        if (rec.isRecording) return "error already recording";
+        if (daemon.capture.windowLost) return "error captured window is gone";
+        auto start = std::chrono::steady_clock::now();
+        rec.filename = argument.empty() ? uniqueFilename(timestampedFilename("recording")) : argument;
+        int width, height;
+        captureSize(daemon.capture, width, height);
+        rec.isRecording = true;
+        if (!initRecording(rec, width, height)) {
+            rec.isRecording = false;
+            return "error could not start recording";
         }
-        SDL_FreeSurface(textSurface);
+        snprintf(reply, sizeof(reply), "ok started %s in %.1f ms",
+                 (rec.lossless ? rec.spoolFilename : rec.filename).c_str(), millisecondsSince(start));
+        return reply;
+    }
+    if (command == "stop") {
+        if (!rec.isRecording || rec.replaySeconds > 0) return "error not recording";
+        auto start = std::chrono::steady_clock::now();
+        std::string filename = rec.lossless ? rec.spoolFilename : rec.filename;
+        cleanupRecording(rec);
+        if (rec.lossless) transcodeInBackground(daemon.transcodes, rec.spoolFilename, rec.profile);
+        int width, height;
+        captureSize(daemon.capture, width, height);
+        prewarmInBackground(rec, width, height);
+        snprintf(reply, sizeof(reply), "ok stopped %s in %.1f ms", filename.c_str(), millisecondsSince(start));
+        return reply;
+    }
+    if (command == "save") {
+        return saveReplay(rec) ? "ok" : "error could not save replay";
+    }
+    if (command == "mark") {
+        std::string error;
+        return markChapter(rec, argument, error) ? "ok" : "error " + error;
+    }
+    if (command == "stats") {
+        TelemetrySnapshot snapshot = takeTelemetrySnapshot();
+        std::string json = telemetryJson(snapshot, &daemon.lastSnapshot, rec);
+        daemon.lastSnapshot = snapshot;
+        return json;
     }
+    if (command == "quit") {
+        daemon.running = false;
+        return "ok";
+    }
+    return "error unknown command " + command;
 }
 
-bool initRecording(RecordingContext& ctx, int width, int height) {
-    ctx.filename = "recording.mp4";
-    ctx.isInitialized = false;
-    ctx.frameBuffer.clear();
+bool isSocketPath(const std::string& path) {
+    struct stat info;
+    return lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode);
+}
 
-    const AVCodec* videoCodec = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!videoCodec) {
-        std::cerr << "H.264 codec not found\n";
+// Only a socket nobody is listening on is replaced; anything else at the path is left alone,
+// so a mistyped --control never deletes a user file or steals a running daemon's socket.
+bool removeStaleSocket(const std::string& path, const sockaddr_un& address) {
+    struct stat info;
+    if (lstat(path.c_str(), &info) < 0) return errno == ENOENT;
+    if (!S_ISSOCK(info.st_mode)) {
+        std::cerr << "Control socket path exists and is not a socket: " << path << "\n";
         return false;
     }
 
-    ctx.videoCodecContext = avcodec_alloc_context3(videoCodec);
-    if (!ctx.videoCodecContext) {
-        std::cerr << "Could not allocate video codec context\n";
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) return false;
+    bool refused = connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 &&
+                   errno == ECONNREFUSED;
+    close(probe);
+    if (!refused) {
+        std::cerr << "Control socket " << path << " is in use by another process\n";
         return false;
     }
+    return unlink(path.c_str()) == 0;
+}
 
-    ctx.videoCodecContext->codec_id = AV_CODEC_ID_H264;
-    ctx.videoCodecContext->bit_rate = TARGET_BITRATE;
-    ctx.videoCodecContext->width = TARGET_WIDTH;
-    ctx.videoCodecContext->height = TARGET_HEIGHT;
-    ctx.videoCodecContext->time_base = (AVRational){1, TARGET_FPS};
-    ctx.videoCodecContext->framerate = (AVRational){TARGET_FPS, 1};
-    ctx.videoCodecContext->gop_size = 10;
-    ctx.videoCodecContext->max_b_frames = 1;
-    ctx.videoCodecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-    
-    av_opt_set(ctx.videoCodecContext->priv_data, "preset", "medium", 0);
-    av_opt_set(ctx.videoCodecContext->priv_data, "tune", "film", 0);
-    av_opt_set(ctx.videoCodecContext->priv_data, "crf", "18", 0);
-
-    if (avcodec_open2(ctx.videoCodecContext, videoCodec, nullptr) < 0) {
-        std::cerr << "Could not open video codec\n";
-        return false;
+int openControlSocket(const std::string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Control socket path too long: " << path << "\n";
+        return -1;
     }
+    strcpy(address.sun_path, path.c_str());
+    if (!removeStaleSocket(path, address)) return -1;
 
-    ctx.swsContext = sws_getContext(width, height, AV_PIX_FMT_BGR24,
-                                   TARGET_WIDTH, TARGET_HEIGHT, AV_PIX_FMT_YUV420P,
-                                   SWS_BICUBIC, nullptr, nullptr, nullptr);
-    if (!ctx.swsContext) {
-        std::cerr << "Could not create SWS context\n";
-        return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Could not create control socket\n";
+        return -1;
     }
-
-    ctx.videoFrame = av_frame_alloc();
-    ctx.videoFrame->format = ctx.videoCodecContext->pix_fmt;
-    ctx.videoFrame->width = ctx.videoCodecContext->width;
-    ctx.videoFrame->height = ctx.videoCodecContext->height;
-    if (av_frame_get_buffer(ctx.videoFrame, 32) < 0) {
-        std::cerr << "Could not allocate video frame data\n";
-        return false;
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, 4) < 0) {
+        std::cerr << "Could not listen on " << path << ": " << strerror(errno) << "\n";
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    ctx.videoFrameNumber = 0;
-    ctx.isInitialized = true;
+bool readControlLines(Daemon& daemon, ControlClient& client, bool console) {
+    char buffer[1024];
+    ssize_t received = read(client.fd, buffer, sizeof(buffer));
+    if (received <= 0) return false;
+    client.pending.append(buffer, received);
+
+    size_t newline;
+    while ((newline = client.pending.find('\n')) != std::string::npos) {
+        std::string line = client.pending.substr(0, newline);
+        client.pending.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        std::string reply = handleControlCommand(daemon, line) + "\n";
+        if (console) {
+            std::cout << reply << std::flush;
+        } else {
+            send(client.fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+        }
+    }
     return true;
 }
 
-void writeFrame(RecordingContext& ctx, const uint8_t* data, int width, int height) {
-    if (!ctx.isRecording || !ctx.isInitialized) return;
+int runHeadless(const Options& options) {
+    Display* display = XOpenDisplay(nullptr);
+    if (!display) {
+        std::cerr << "Can't open X11 display\n";
+        return 1;
+    }
 
-    const uint8_t* srcData[1] = { data };
-    int srcLinesize[1] = { width * 3 };
-    
-    sws_scale(ctx.swsContext, srcData, srcLinesize, 0, height, 
-             ctx.videoFrame->data, ctx.videoFrame->linesize);
-
-    ctx.videoFrame->pts = ctx.videoFrameNumber++;
-
-    size_t frameSize = av_image_get_buffer_size(ctx.videoCodecContext->pix_fmt, 
-                                              ctx.videoCodecContext->width, 
-                                              ctx.videoCodecContext->height, 1);
-    std::vector<uint8_t> frameData(frameSize);
-    av_image_copy_to_buffer(frameData.data(), frameSize,
-                          (const uint8_t* const*)ctx.videoFrame->data,
-                          ctx.videoFrame->linesize,
-                          ctx.videoCodecContext->pix_fmt,
-                          ctx.videoCodecContext->width,
-                          ctx.videoCodecContext->height, 1);
-    
-    ctx.frameBuffer.insert(ctx.frameBuffer.end(), frameData.begin(), frameData.end());
-}
+    Window root = DefaultRootWindow(display);
+    int x = 0, y = 0, width = 0, height = 0;
+    if (!resolveCaptureArea(display, root, options, x, y, width, height)) {
+        XCloseDisplay(display);
+        return 1;
+    }
 
-void cleanupRecording(RecordingContext& ctx) {
-    if (!ctx.isInitialized) return;
+    int listenFd = -1;
+    if (!options.controlSocket.empty()) {
+        listenFd = openControlSocket(options.controlSocket);
+        if (listenFd < 0) {
+            XCloseDisplay(display);
+            return 1;
+        }
+    }
 
-    finalizeRecording(ctx);
+    ScreenCapture capture{};
+    initCapture(capture, display, root, options.windowId, x, y, width, height, options.useShm,
+                options.drawCursor);
 
-    if (ctx.videoFrame) av_frame_free(&ctx.videoFrame);
-    if (ctx.swsContext) sws_freeContext(ctx.swsContext);
-    if (ctx.videoCodecContext) avcodec_free_context(&ctx.videoCodecContext);
-    if (ctx.formatContext) avformat_free_context(ctx.formatContext);
-    
-    ctx.isRecording = false;
-    ctx.isInitialized = false;
-    ctx.frameBuffer.clear();
+    RecordingContext recordingContext{};
+    applyOptions(recordingContext, options);
+    if (options.replaySeconds > 0) {
+        recordingContext.isRecording = true;
+        if (!initRecording(recordingContext, width, height)) {
+            recordingContext.isRecording = false;
+            std::cerr << "Failed to start replay buffer\n";
+        }
+    } else {
+        prewarmInBackground(recordingContext, width, height);
+    }
+
+    PreviewBuffer preview{};
+    std::atomic<bool> capturing(true);
+    X11FrameSource frameSource(capture);
+    std::thread captureThread(captureLoop, std::ref(frameSource), std::ref(recordingContext),
+                              std::ref(preview), std::ref(capturing));
+
+    Daemon daemon{recordingContext, capture, takeTelemetrySnapshot(), {}, true};
+    ControlClient console = {STDIN_FILENO, ""};
+    bool consoleOpen = true;
+    std::vector<ControlClient> clients;
+    std::cout << "ready " << width << "x" << height << std::endl;
+
+    while (daemon.running && (consoleOpen || listenFd >= 0)) {
+        std::vector<pollfd> fds;
+        if (consoleOpen) fds.push_back({console.fd, POLLIN, 0});
+        if (listenFd >= 0) fds.push_back({listenFd, POLLIN, 0});
+        for (const ControlClient& client : clients) fds.push_back({client.fd, POLLIN, 0});
+
+        if (poll(fds.data(), fds.size(), options.windowId ? 250 : -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (capture.windowLost && recordingContext.isRecording && recordingContext.replaySeconds == 0) {
+            std::cerr << "Stopping recording, captured window is gone\n";
+            cleanupRecording(recordingContext);
+            if (recordingContext.lossless) {
+                transcodeInBackground(daemon.transcodes, recordingContext.spoolFilename, recordingContext.profile);
+            }
+        }
+
+        size_t index = 0;
+        if (consoleOpen && fds[index++].revents) {
+            consoleOpen = readControlLines(daemon, console, true);
+        }
+        if (listenFd >= 0 && fds[index++].revents & POLLIN) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) clients.push_back({fd, ""});
+        }
+        for (size_t i = 0; i < clients.size() && index < fds.size(); index++) {
+            if (fds[index].revents && !readControlLines(daemon, clients[i], false)) {
+                close(clients[i].fd);
+                clients.erase(clients.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    capturing = false;
+    captureThread.join();
+    if (recordingContext.isRecording) {
+        cleanupRecording(recordingContext);
+        if (recordingContext.lossless) {
+            transcodeInBackground(daemon.transcodes, recordingContext.spoolFilename, recordingContext.profile);
+        }
+    }
+    releaseWarmEncoder(recordingContext);
+    joinTranscodes(daemon.transcodes);
+
+    for (const ControlClient& client : clients) close(client.fd);
+    if (listenFd >= 0) {
+        close(listenFd);
+        if (isSocketPath(options.controlSocket)) unlink(options.controlSocket.c_str());
+    }
+    cleanupCapture(capture);
+    XCloseDisplay(display);
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
     av_log_set_level(AV_LOG_ERROR);
+    Options options = parseOptions(argc, argv);
+    if (options.benchConvert) {
+        int result = runConvertBenchmark();
+        return runIncrementalQueueChecks(1920, 1080) ? result : 1;
+    }
+    if (options.benchScale) {
+        return runScaleBenchmark();
+    }
+    if (options.benchAudio) {
+        return runAudioDriftBenchmark();
+    }
+    if (options.benchCrash) {
+        return runCrashRecoveryTest(options);
+    }
+    if (options.benchRestart) {
+        return runSessionRestartTest(options);
+    }
+    if (!options.transcodeInput.empty()) {
+        return transcodeSpool(options.transcodeInput, transcodeFilename(options.transcodeInput),
+                              ENCODER_PROFILES[options.profile]) ? 0 : 1;
+    }
+    if (!options.benchScene.empty()) {
+        return runPipelineBenchmark(options);
+    }
+    installErrorTrapHandler();
+    if (options.headless) {
+        return runHeadless(options);
+    }
     
     SDL_Window* window = nullptr;
     SDL_Renderer* renderer = nullptr;
@@ -323,9 +5106,12 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    TTF_Font* font = TTF_OpenFont("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf", 16);
-    if (!font) {
+    TTF_Font* font = TTF_OpenFont(FONT_PATH, 16);
+    TTF_Font* overlayFont = TTF_OpenFont(FONT_PATH, 11);
+    if (!font || !overlayFont) {
         std::cerr << "Failed to load font: " << TTF_GetError() << std::endl;
+        if (font) TTF_CloseFont(font);
+        if (overlayFont) TTF_CloseFont(overlayFont);
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
         TTF_Quit();
@@ -338,6 +5124,7 @@ int main(int argc, char* argv[]) {
         std::cerr << "Can't open X11 display\n";
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
+        TTF_CloseFont(overlayFont);
         TTF_CloseFont(font);
         TTF_Quit();
         SDL_Quit();
@@ -345,43 +5132,34 @@ int main(int argc, char* argv[]) {
     }
 
     Window root = DefaultRootWindow(display);
-    XRRScreenResources* screenRes = XRRGetScreenResources(display, root);
-    RROutput primaryOutput = XRRGetOutputPrimary(display, root);
-    XRROutputInfo* outputInfo = nullptr;
-    XRRCrtcInfo* crtcInfo = nullptr;
     int x = 0, y = 0, width = 0, height = 0;
-
-    for (int i = 0; i < screenRes->noutput; ++i) {
-        if (screenRes->outputs[i] == primaryOutput) {
-            outputInfo = XRRGetOutputInfo(display, screenRes, screenRes->outputs[i]);
-            if (outputInfo && outputInfo->crtc) {
-                crtcInfo = XRRGetCrtcInfo(display, screenRes, outputInfo->crtc);
-                x = crtcInfo->x;
-                y = crtcInfo->y;
-                width = crtcInfo->width;
-                height = crtcInfo->height;
-            }
-            break;
-        }
+    if (!resolveCaptureArea(display, root, options, x, y, width, height)) {
+        XCloseDisplay(display);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        TTF_CloseFont(overlayFont);
+        TTF_CloseFont(font);
+        TTF_Quit();
+        SDL_Quit();
+        return 1;
     }
 
-    if (width == 0 || height == 0) {
-        std::cerr << "Could not get screen resolution, defaulting to 1920x1080\n";
-        width = 1920;
-        height = 1080;
-    }
+    ScreenCapture capture{};
+    initCapture(capture, display, root, options.windowId, x, y, width, height, options.useShm,
+                options.drawCursor);
 
+    int previewWidth = static_cast<int>(width * PREVIEW_SCALE) & ~1;
+    int previewHeight = static_cast<int>(height * PREVIEW_SCALE) & ~1;
     SDL_Texture* texture = SDL_CreateTexture(renderer,
-        SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
-        width, height);
+        SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING,
+        previewWidth, previewHeight);
     if (!texture) {
         std::cerr << "Texture error: " << SDL_GetError() << std::endl;
-        if (crtcInfo) XRRFreeCrtcInfo(crtcInfo);
-        if (outputInfo) XRRFreeOutputInfo(outputInfo);
-        XRRFreeScreenResources(screenRes);
+        cleanupCapture(capture);
         XCloseDisplay(display);
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
+        TTF_CloseFont(overlayFont);
         TTF_CloseFont(font);
         TTF_Quit();
         SDL_Quit();
@@ -396,30 +5174,77 @@ int main(int argc, char* argv[]) {
     };
 
     RecordingContext recordingContext{};
-    recordingContext.isRecording = false;
-    recordingContext.isInitialized = false;
+    applyOptions(recordingContext, options);
+    if (options.replaySeconds > 0) {
+        recordButton.label = "Save Replay";
+        recordingContext.isRecording = true;
+        if (!initRecording(recordingContext, width, height)) {
+            recordingContext.isRecording = false;
+            std::cerr << "Failed to start replay buffer\n";
+        }
+    } else {
+        prewarmInBackground(recordingContext, width, height);
+    }
     bool running = true;
     SDL_Event event;
 
-    auto lastFrameTime = std::chrono::steady_clock::now();
-    const std::chrono::milliseconds frameDuration(1000 / TARGET_FPS);
+    PreviewBuffer preview{};
+    preview.width = previewWidth;
+    preview.height = previewHeight;
+    preview.fps = options.previewFps;
+    preview.whileRecording = options.previewWhileRecording;
+    Uint32 previewEvent = SDL_RegisterEvents(1);
+    preview.eventType = previewEvent == static_cast<Uint32>(-1) ? 0 : previewEvent;
+    std::vector<TranscodeWorker> transcodes;
+    std::atomic<bool> capturing(true);
+    X11FrameSource frameSource(capture);
+    std::thread captureThread(captureLoop, std::ref(frameSource), std::ref(recordingContext),
+                              std::ref(preview), std::ref(capturing));
+
+    auto lastStatsTime = std::chrono::steady_clock::now();
+    TelemetrySnapshot lastSnapshot = takeTelemetrySnapshot();
+    TextCache textCache{};
+    std::string overlayText;
+    uint64_t lastCpuMicros = threadCpuMicros();
+    bool needsRedraw = true;
+    std::ofstream statsFile;
+    if (!options.statsFile.empty()) {
+        statsFile.open(options.statsFile, std::ios::app);
+        if (!statsFile) std::cerr << "Could not open stats file " << options.statsFile << "\n";
+    }
 
     while (running) {
+        auto untilStats = std::chrono::duration_cast<std::chrono::milliseconds>(
+            lastStatsTime + std::chrono::seconds(1) - std::chrono::steady_clock::now());
+        bool haveEvent = SDL_WaitEventTimeout(&event, std::max(0, static_cast<int>(untilStats.count()))) != 0;
         auto now = std::chrono::steady_clock::now();
-        auto elapsed = now - lastFrameTime;
-        
-        while (SDL_PollEvent(&event)) {
+
+        while (haveEvent) {
             if (event.type == SDL_QUIT) {
                 running = false;
             }
+            else if (preview.eventType && event.type == preview.eventType) {
+                needsRedraw = true;
+            }
+            else if (event.type == SDL_WINDOWEVENT) {
+                needsRedraw = true;
+            }
+            else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F9 &&
+                     recordingContext.replaySeconds > 0) {
+                saveReplay(recordingContext);
+            }
             else if (event.type == SDL_MOUSEMOTION) {
                 int mouseX = event.motion.x;
                 int mouseY = event.motion.y;
-                recordButton.isHovered = 
+                bool hovered =
                     (mouseX >= recordButton.rect.x && 
                      mouseX <= recordButton.rect.x + recordButton.rect.w &&
                      mouseY >= recordButton.rect.y && 
                      mouseY <= recordButton.rect.y + recordButton.rect.h);
+                if (hovered != recordButton.isHovered) {
+                    recordButton.isHovered = hovered;
+                    needsRedraw = true;
+                }
             }
             else if (event.type == SDL_MOUSEBUTTONDOWN) {
                 if (event.button.button == SDL_BUTTON_LEFT) {
@@ -430,16 +5255,28 @@ int main(int argc, char* argv[]) {
                         mouseY >= recordButton.rect.y && 
                         mouseY <= recordButton.rect.y + recordButton.rect.h) {
                         recordButton.isPressed = true;
+                        needsRedraw = true;
                     }
                 }
             }
             else if (event.type == SDL_MOUSEBUTTONUP) {
-                if (event.button.button == SDL_BUTTON_LEFT && recordButton.isPressed) {
+                if (event.button.button == SDL_BUTTON_LEFT && recordButton.isPressed &&
+                    recordingContext.replaySeconds > 0) {
+                    recordButton.isPressed = false;
+                    saveReplay(recordingContext);
+                }
+                else if (event.button.button == SDL_BUTTON_LEFT && recordButton.isPressed) {
                     recordButton.isPressed = false;
                     recordingContext.isRecording = !recordingContext.isRecording;
                     recordButton.label = recordingContext.isRecording ? "Stop Recording" : "Start Recording";
+                    needsRedraw = true;
                     
-                    if (recordingContext.isRecording) {
+                    if (recordingContext.isRecording && capture.windowLost) {
+                        recordingContext.isRecording = false;
+                        recordButton.label = "Start Recording";
+                        std::cerr << "Captured window is gone, not recording\n";
+                    } else if (recordingContext.isRecording) {
+                        captureSize(capture, width, height);
                         if (!initRecording(recordingContext, width, height)) {
                             recordingContext.isRecording = false;
                             recordButton.label = "Start Recording";
@@ -447,106 +5284,141 @@ int main(int argc, char* argv[]) {
                         }
                     } else {
                         cleanupRecording(recordingContext);
+                        if (recordingContext.lossless) {
+                            transcodeInBackground(transcodes, recordingContext.spoolFilename,
+                                                  recordingContext.profile);
+                        }
+                        captureSize(capture, width, height);
+                        prewarmInBackground(recordingContext, width, height);
                     }
                 }
             }
+            haveEvent = SDL_PollEvent(&event) != 0;
         }
 
+        if (capture.windowLost && recordingContext.isRecording && recordingContext.replaySeconds == 0) {
+            std::cerr << "Stopping recording, captured window is gone\n";
+            cleanupRecording(recordingContext);
+            if (recordingContext.lossless) {
+                transcodeInBackground(transcodes, recordingContext.spoolFilename, recordingContext.profile);
+            }
+            recordButton.label = "Start Recording";
+            needsRedraw = true;
+        }
 
-        XImage* img = XGetImage(display, root, x, y, width, height, AllPlanes, ZPixmap);
-        if (img) {
-            if (img->bits_per_pixel == 32) {
-                bool isARGB = (img->red_mask == 0xff0000 && 
-                            img->green_mask == 0xff00 && 
-                            img->blue_mask == 0xff);
-                
-                bool isBGRA = (img->blue_mask == 0xff0000 && 
-                            img->green_mask == 0xff00 && 
-                            img->red_mask == 0xff);
-                
-                if (isARGB || isBGRA) {
-                    SDL_UpdateTexture(texture, nullptr, img->data, img->bytes_per_line);
-                    
-                    if (recordingContext.isRecording) {
-                        uint8_t* bgrData = new uint8_t[width * height * 3];
-                        for (int y = 0; y < height; y++) {
-                            for (int x = 0; x < width; x++) {
-                                uint32_t pixel = *((uint32_t*)(img->data + y * img->bytes_per_line + x * 4));
-                                uint8_t r = (pixel & img->red_mask) >> 16;
-                                uint8_t g = (pixel & img->green_mask) >> 8;
-                                uint8_t b = (pixel & img->blue_mask);
-                                
-                                int offset = (y * width + x) * 3;
-                                bgrData[offset] = b;
-                                bgrData[offset + 1] = g;
-                                bgrData[offset + 2] = r;
-                            }
-                        }
-                        writeFrame(recordingContext, bgrData, width, height);
-                        delete[] bgrData;
-                    }
-                } else {
-                    std::cerr << "Unsupported 32bpp pixel format\n";
-                }
-            } else if (img->bits_per_pixel == 24) {
-                SDL_UpdateTexture(texture, nullptr, img->data, img->bytes_per_line);
-                if (recordingContext.isRecording) {
-                    writeFrame(recordingContext, (uint8_t*)img->data, width, height);
-                }
-            } else {
-                std::cerr << "Unsupported image format: " << img->bits_per_pixel << " bpp\n";
+        {
+            std::lock_guard<std::mutex> lock(preview.mutex);
+            if (preview.updated) {
+                int lumaSize = preview.width * preview.height;
+                const uint8_t* luma = preview.pixels.data();
+                SDL_UpdateYUVTexture(texture, nullptr, luma, preview.width,
+                                     luma + lumaSize, preview.width / 2,
+                                     luma + lumaSize + lumaSize / 4, preview.width / 2);
+                preview.updated = false;
             }
-            XDestroyImage(img);
         }
 
-        SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
-        SDL_RenderClear(renderer);
+        if (now - lastStatsTime >= std::chrono::seconds(1)) {
+            TelemetrySnapshot snapshot = takeTelemetrySnapshot();
+            StageSummary captureSummary = summarizeStage(snapshot, &lastSnapshot,
+                                                         static_cast<int>(PipelineStage::Capture));
+
+            char title[256];
+            int written = snprintf(title, sizeof(title), "Wumbo Recorder - capture %.2f ms/frame (%s)",
+                                   captureSummary.meanMs, capture.useShm ? "XShm" : "XGetImage");
+            if (recordingContext.isRecording) {
+                snprintf(title + written, sizeof(title) - written, " - late %lld, duplicated %lld, dropped %lld",
+                         static_cast<long long>(recordingContext.lateFrames),
+                         static_cast<long long>(recordingContext.duplicatedFrames),
+                         static_cast<long long>(recordingContext.droppedFrames));
+                written = strlen(title);
+                if (recordingContext.deduplicate && recordingContext.capturedFrames > 0) {
+                    snprintf(title + written, sizeof(title) - written, ", skipped %lld%%",
+                             static_cast<long long>(100 * recordingContext.skippedFrames /
+                                                    recordingContext.capturedFrames));
+                }
+            }
+            uint64_t cpuMicros = threadCpuMicros();
+            double elapsedMicros = std::chrono::duration<double, std::micro>(now - lastStatsTime).count();
+            written = strlen(title);
+            snprintf(title + written, sizeof(title) - written, " - ui %.1f%% cpu",
+                     100.0 * (cpuMicros - lastCpuMicros) / elapsedMicros);
+            telemetry.uiCpuMicros.fetch_add(cpuMicros - lastCpuMicros, std::memory_order_relaxed);
+            lastCpuMicros = cpuMicros;
+            SDL_SetWindowTitle(window, title);
 
-        SDL_SetRenderDrawColor(renderer, 45, 45, 45, 255);
-        SDL_Rect toolbarRect = {0, 0, WINDOW_WIDTH, TOOLBAR_HEIGHT};
-        SDL_RenderFillRect(renderer, &toolbarRect);
+            std::string overlay = telemetryOverlayText(snapshot, &lastSnapshot, recordingContext);
+            if (overlay != overlayText) {
+                overlayText = overlay;
+                needsRedraw = true;
+            }
 
-        SDL_SetRenderDrawColor(renderer, 20, 20, 20, 255);
-        SDL_Rect previewBgRect = {0, TOOLBAR_HEIGHT, WINDOW_WIDTH, WINDOW_HEIGHT - TOOLBAR_HEIGHT};
-        SDL_RenderFillRect(renderer, &previewBgRect);
+            if (statsFile.is_open()) {
+                statsFile << telemetryJson(snapshot, &lastSnapshot, recordingContext) << std::endl;
+            }
 
-        int previewWidth = static_cast<int>(width * PREVIEW_SCALE);
-        int previewHeight = static_cast<int>(height * PREVIEW_SCALE);
-        int previewX = (WINDOW_WIDTH - previewWidth) / 2;
-        int previewY = TOOLBAR_HEIGHT + (WINDOW_HEIGHT - TOOLBAR_HEIGHT - previewHeight) / 2;
+            lastSnapshot = snapshot;
+            lastStatsTime = now;
+        }
 
-        SDL_Rect previewRect = {previewX, previewY, previewWidth, previewHeight};
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderFillRect(renderer, &previewRect);
-        SDL_SetRenderDrawColor(renderer, 60, 60, 60, 255);
-        SDL_RenderDrawRect(renderer, &previewRect);
+        if (needsRedraw) {
+            SDL_SetRenderDrawColor(renderer, 30, 30, 30, 255);
+            SDL_RenderClear(renderer);
 
-        SDL_RenderCopy(renderer, texture, nullptr, &previewRect);
-        drawButton(renderer, recordButton, font);
+            SDL_SetRenderDrawColor(renderer, 45, 45, 45, 255);
+            SDL_Rect toolbarRect = {0, 0, WINDOW_WIDTH, TOOLBAR_HEIGHT};
+            SDL_RenderFillRect(renderer, &toolbarRect);
 
-        if (recordingContext.isRecording) {
-            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-            SDL_Rect recordingIndicator = {10, 10, 10, 10};
-            SDL_RenderFillRect(renderer, &recordingIndicator);
-        }
+            SDL_SetRenderDrawColor(renderer, 20, 20, 20, 255);
+            SDL_Rect previewBgRect = {0, TOOLBAR_HEIGHT, WINDOW_WIDTH, WINDOW_HEIGHT - TOOLBAR_HEIGHT};
+            SDL_RenderFillRect(renderer, &previewBgRect);
 
-        SDL_RenderPresent(renderer);
+            int previewX = (WINDOW_WIDTH - previewWidth) / 2;
+            int previewY = TOOLBAR_HEIGHT + (WINDOW_HEIGHT - TOOLBAR_HEIGHT - previewHeight) / 2;
 
-        auto processingTime = std::chrono::steady_clock::now() - now;
-        if (processingTime < frameDuration) {
-            std::this_thread::sleep_for(frameDuration - processingTime);
+            SDL_Rect previewRect = {previewX, previewY, previewWidth, previewHeight};
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderFillRect(renderer, &previewRect);
+            SDL_SetRenderDrawColor(renderer, 60, 60, 60, 255);
+            SDL_RenderDrawRect(renderer, &previewRect);
+
+            SDL_RenderCopy(renderer, texture, nullptr, &previewRect);
+            drawButton(renderer, recordButton, font, textCache);
+            CachedText* overlay = cachedText(textCache, renderer, overlayFont, overlayText, OVERLAY_TEXT_COLOR);
+            if (overlay) {
+                SDL_Rect overlayRect = {30, (TOOLBAR_HEIGHT - overlay->height) / 2, overlay->width, overlay->height};
+                SDL_RenderCopy(renderer, overlay->texture, nullptr, &overlayRect);
+            }
+
+            if (recordingContext.isRecording) {
+                SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+                SDL_Rect recordingIndicator = {10, 10, 10, 10};
+                SDL_RenderFillRect(renderer, &recordingIndicator);
+            }
+
+            SDL_RenderPresent(renderer);
+            telemetry.uiRedraws.fetch_add(1, std::memory_order_relaxed);
+            needsRedraw = false;
         }
-        lastFrameTime = std::chrono::steady_clock::now();
     }
 
+    capturing = false;
+    captureThread.join();
+    if (preview.scaler) sws_freeContext(preview.scaler);
+
     if (recordingContext.isRecording) {
         cleanupRecording(recordingContext);
+        if (recordingContext.lossless) {
+            transcodeInBackground(transcodes, recordingContext.spoolFilename, recordingContext.profile);
+        }
     }
+    joinTranscodes(transcodes);
 
-    if (crtcInfo) XRRFreeCrtcInfo(crtcInfo);
-    if (outputInfo) XRRFreeOutputInfo(outputInfo);
-    XRRFreeScreenResources(screenRes);
+    releaseWarmEncoder(recordingContext);
+    cleanupCapture(capture);
     XCloseDisplay(display);
+    clearTextCache(textCache);
+    TTF_CloseFont(overlayFont);
     TTF_CloseFont(font);
     SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);